@@ -0,0 +1,263 @@
+/*
+ * mpd2irc - MPD->IRC gateway
+ *
+ * Copyright 2008-2011 Christoph Mende
+ * All rights reserved. Released under the 2-clause BSD license.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+#include <mpd/client.h>
+
+#include "capture.h"
+#include "irc.h"
+#include "mpd.h"
+#include "timer.h"
+
+/*
+ * A capture is a text file with one record per line:
+ *
+ *   <microseconds since start> TAB <kind> TAB <escaped payload>
+ *
+ * kind is 'I' for an inbound IRC line, 'S' for an MPD status response and
+ * 'C' for an MPD current song response, or 'c' for one that was taken
+ * without announcing it (a song unchanged across a reconnect), so replay
+ * follows the same path the live run did.  MPD payloads are the protocol's
+ * "name: value" pairs separated by newlines, so they can be fed back
+ * through libmpdclient's own parsers.
+ */
+
+static void capture_record(gchar kind, const gchar *payload);
+static void capture_replay_record(gchar kind, gchar *payload);
+static struct mpd_pair *capture_parse_pairs(gchar *payload, guint *count);
+
+static FILE *capture_file = NULL;
+static gint64 capture_start;
+static gchar capture_exceptions[129];
+
+gboolean capture_open(const gchar *path)
+{
+	capture_file = fopen(path, "w");
+	if (!capture_file) {
+		g_warning("Failed to open capture file %s", path);
+		return FALSE;
+	}
+	setvbuf(capture_file, NULL, _IOLBF, 0);
+
+	/* keep UTF-8 readable, only escape control characters */
+	for (guint i = 0; i < 128; i++)
+		capture_exceptions[i] = (gchar) (i + 128);
+	capture_exceptions[128] = '\0';
+
+	capture_start = g_get_monotonic_time();
+	return TRUE;
+}
+
+void capture_irc(const gchar *line)
+{
+	if (!capture_file)
+		return;
+
+	capture_record('I', line);
+}
+
+void capture_mpd_status(const struct mpd_status *status)
+{
+	GString *pairs;
+
+	if (!capture_file || !status)
+		return;
+
+	pairs = g_string_new(NULL);
+	switch (mpd_status_get_state(status)) {
+		case MPD_STATE_STOP:
+			g_string_append(pairs, "state: stop\n"); break;
+		case MPD_STATE_PLAY:
+			g_string_append(pairs, "state: play\n"); break;
+		case MPD_STATE_PAUSE:
+			g_string_append(pairs, "state: pause\n"); break;
+		default:
+			break;
+	}
+	g_string_append_printf(pairs, "repeat: %i\nrandom: %i\ntime: %u:%u",
+			mpd_status_get_repeat(status),
+			mpd_status_get_random(status),
+			mpd_status_get_elapsed_time(status),
+			mpd_status_get_total_time(status));
+
+	capture_record('S', pairs->str);
+	g_string_free(pairs, TRUE);
+}
+
+void capture_mpd_song(const struct mpd_song *song, gboolean announced)
+{
+	const enum mpd_tag_type tags[] = {
+		MPD_TAG_ARTIST, MPD_TAG_TITLE, MPD_TAG_ALBUM
+	};
+	GString *pairs;
+
+	if (!capture_file)
+		return;
+
+	pairs = g_string_new(NULL);
+	if (song) {
+		g_string_append_printf(pairs, "file: %s\nTime: %u",
+				mpd_song_get_uri(song),
+				mpd_song_get_duration(song));
+		for (guint i = 0; i < G_N_ELEMENTS(tags); i++) {
+			const gchar *value = mpd_song_get_tag(song, tags[i], 0);
+			if (value)
+				g_string_append_printf(pairs, "\n%s: %s",
+						mpd_tag_name(tags[i]), value);
+		}
+	}
+
+	capture_record(announced ? 'C' : 'c', pairs->str);
+	g_string_free(pairs, TRUE);
+}
+
+void capture_close(void)
+{
+	if (capture_file)
+		fclose(capture_file);
+	capture_file = NULL;
+}
+
+static void capture_record(gchar kind, const gchar *payload)
+{
+	gchar *escaped = g_strescape(payload, capture_exceptions);
+
+	fprintf(capture_file, "%" G_GINT64_FORMAT "\t%c\t%s\n",
+			g_get_monotonic_time() - capture_start, kind, escaped);
+	g_free(escaped);
+}
+
+gboolean capture_replay(const gchar *path, gboolean realtime)
+{
+	GError *error = NULL;
+	GIOChannel *channel;
+	GIOStatus status;
+	gchar *line, *kind, *payload;
+	gsize terminator;
+	gint64 start, offset;
+	guint records = 0;
+
+	channel = g_io_channel_new_file(path, "r", &error);
+	if (!channel) {
+		g_warning("Failed to open capture file %s: %s", path,
+				error->message);
+		g_error_free(error);
+		return FALSE;
+	}
+	g_io_channel_set_encoding(channel, NULL, NULL);
+
+	start = g_get_monotonic_time();
+	while ((status = g_io_channel_read_line(channel, &line, NULL,
+					&terminator, &error)) ==
+			G_IO_STATUS_NORMAL) {
+		line[terminator] = '\0';
+
+		offset = g_ascii_strtoll(line, &kind, 10);
+		if (kind[0] != '\t' || kind[1] == '\0' || kind[2] != '\t') {
+			g_warning("Skipping malformed capture record: %s",
+					line);
+			g_free(line);
+			continue;
+		}
+
+		if (realtime) {
+			gint64 wait = offset - (g_get_monotonic_time() - start);
+			if (wait > 0)
+				g_usleep(wait);
+		}
+		/* fire the timers that would have run in the meantime */
+		if (offset > timer_now())
+			timer_advance(offset - timer_now());
+
+		payload = g_strcompress(kind + 3);
+		capture_replay_record(kind[1], payload);
+		g_free(payload);
+		g_free(line);
+		records++;
+	}
+	g_io_channel_unref(channel);
+
+	if (status == G_IO_STATUS_ERROR) {
+		g_warning("Failed to read capture file %s: %s", path,
+				error->message);
+		g_error_free(error);
+		return FALSE;
+	}
+
+	g_message("Replayed %u records in %.3f s", records,
+			(g_get_monotonic_time() - start) / 1e6);
+	return TRUE;
+}
+
+static void capture_replay_record(gchar kind, gchar *payload)
+{
+	struct mpd_pair *pairs;
+	struct mpd_status *status;
+	struct mpd_song *song = NULL;
+	guint count;
+
+	if (kind == 'I') {
+		irc_parse(payload);
+		return;
+	}
+
+	pairs = capture_parse_pairs(payload, &count);
+	if (kind == 'S') {
+		status = mpd_status_begin();
+		for (guint i = 0; i < count; i++)
+			mpd_status_feed(status, &pairs[i]);
+		mpd_set_status(status);
+	} else if (kind == 'C' || kind == 'c') {
+		for (guint i = 0; i < count; i++) {
+			if (!song)
+				song = mpd_song_begin(&pairs[i]);
+			else
+				mpd_song_feed(song, &pairs[i]);
+		}
+		if (kind == 'C')
+			mpd_set_song(song);
+		else
+			mpd_store_song(song);
+	} else {
+		g_warning("Skipping unknown capture record type '%c'", kind);
+	}
+	g_free(pairs);
+}
+
+/* splits "name: value" lines in place, pointing into payload */
+static struct mpd_pair *capture_parse_pairs(gchar *payload, guint *count)
+{
+	struct mpd_pair *pairs;
+	gchar *line, *next, *sep;
+	guint n = 1;
+
+	for (const gchar *p = payload; *p; p++)
+		if (*p == '\n')
+			n++;
+	pairs = g_new(struct mpd_pair, n);
+
+	*count = 0;
+	for (line = payload; line && *line; line = next) {
+		next = strchr(line, '\n');
+		if (next)
+			*next++ = '\0';
+
+		sep = strstr(line, ": ");
+		if (!sep)
+			continue;
+		*sep = '\0';
+		pairs[*count].name = line;
+		pairs[(*count)++].value = sep + 2;
+	}
+
+	return pairs;
+}
@@ -0,0 +1,22 @@
+/*
+ * mpd2irc - MPD->IRC gateway
+ *
+ * Copyright 2008-2011 Christoph Mende
+ * All rights reserved. Released under the 2-clause BSD license.
+ */
+
+
+#ifndef HAVE_CAPTURE_H
+#define HAVE_CAPTURE_H
+
+struct mpd_status;
+struct mpd_song;
+
+gboolean capture_open(const gchar *path);
+void capture_irc(const gchar *line);
+void capture_mpd_status(const struct mpd_status *status);
+void capture_mpd_song(const struct mpd_song *song, gboolean announced);
+void capture_close(void);
+gboolean capture_replay(const gchar *path, gboolean realtime);
+
+#endif /* HAVE_CAPTURE_H */
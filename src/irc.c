@@ -11,64 +11,204 @@
 #include <gio/gio.h>
 #include <glib.h>
 
+#include "capture.h"
 #include "preferences.h"
 #include "mpd.h"
 #include "config.h"
 #include "irc.h"
+#include "notify.h"
+#include "probes.h"
+#include "reconnect.h"
 
 #define IRC_READ_BUF 2048
-
-static void irc_run(const gchar *command);
+#define IRC_MAX_PARAMS 15
+/* 8191 bytes of IRCv3 tags plus a 512 byte message */
+#define IRC_MAX_LINE 8703
+#define IRC_SASL_CHUNK 400
+
+struct irc_message {
+	gchar *tags;
+	gchar *prefix;
+	gchar *command;
+	gchar *params[IRC_MAX_PARAMS];
+	guint nparams;
+};
+
+static void irc_run(const gchar *nick, const gchar *command);
 void irc_say(const gchar *fmt, ...);
-static void irc_connected(GSocketClient *client, GAsyncResult *result,
+static void irc_connected(GSocketClient *source, GAsyncResult *result,
+		gpointer user_data);
+static gboolean irc_client_setup(void);
+static void irc_client_reset(void);
+static void irc_client_event(GSocketClient *source, GSocketClientEvent event,
+		GSocketConnectable *connectable, GIOStream *stream,
 		gpointer user_data);
+static gboolean irc_tls_pinned(void);
 static gboolean irc_callback(GSocket *socket, GIOCondition condition,
 		gpointer user_data);
 static void irc_source_attach(void);
 static void irc_write(const gchar *fmt, ...);
-static void irc_parse(const gchar *buffer);
-static void irc_schedule_reconnect(void);
-
+static gboolean irc_message_parse(gchar *line, struct irc_message *msg);
+static gchar *irc_message_get_tag(const struct irc_message *msg,
+		const gchar *key);
+static void irc_batch(const struct irc_message *msg);
+static gboolean irc_batch_skipped(const struct irc_message *msg);
+static gboolean irc_message_from_self(const struct irc_message *msg);
+static void irc_cap(const struct irc_message *msg);
+static gboolean irc_cap_wanted(const gchar *cap);
+static gboolean irc_cap_listed(const gchar *caps, const gchar *cap);
+static void irc_cap_end(void);
+static void irc_sasl_authenticate(const gchar *challenge);
+static gboolean irc_sasl_failed(const gchar *numeric);
+static void irc_registered(void);
+static void irc_disconnect(void);
+static void irc_connection_lost(void);
+
+static GSocketClient *client = NULL;
+static GSocketConnectable *address = NULL;
+static GTlsCertificate *client_cert = NULL;
+static GTlsClientConnection *last_tls = NULL;
 static GSocketConnection *connection;
+/* the connection attempt in flight, if any */
+static GCancellable *connecting = NULL;
 static gboolean connected = FALSE;
 static GOutputStream *ostream = NULL;
 static GInputStream *istream = NULL;
 static GSource *callback_source;
-static guint reconnect_source = 0;
+static GString *readbuf = NULL;
+static gboolean readbuf_overlong = FALSE;
+static struct reconnect reconnect = { .name = "IRC", .attempt = irc_connect };
+static gboolean cap_negotiating = FALSE;
+static gboolean sasl_done = FALSE;
+/* we sent AUTHENTICATE <mechanism> and wait for the exchange */
+static gboolean sasl_requested = FALSE;
+static GString *cap_request = NULL;
+/* open batches, reference -> type */
+static GHashTable *batches = NULL;
+
+/* IRCv3 capabilities requested when the server offers them */
+static const gchar *irc_caps[] = { "message-tags", "batch", "echo-message" };
 
+/*
+ * The socket client and the server address are kept across reconnects:
+ * the address caches its DNS results and the last TLS connection lets
+ * the next handshake resume the session instead of starting over.
+ */
 gboolean irc_connect(G_GNUC_UNUSED gpointer data)
 {
-	GSocketClient *client;
-	gushort default_port = 6667;
+	if (!client && !irc_client_setup()) {
+		reconnect_failed(&reconnect);
+		return FALSE;
+	}
 
-	client = g_socket_client_new();
-	g_socket_client_set_tls(client, prefs.irc_use_ssl);
-	g_socket_client_set_tls_validation_flags(client, 0);
-	if (prefs.irc_use_ssl)
-		default_port = 6697;
-	g_socket_client_connect_to_host_async(client, prefs.irc_server,
-			default_port, NULL, (GAsyncReadyCallback) irc_connected,
-			NULL);
-	g_object_unref(client);
+	/* a new attempt supersedes one still in flight */
+	if (connecting) {
+		g_cancellable_cancel(connecting);
+		g_object_unref(connecting);
+	}
+	connecting = g_cancellable_new();
+
+	g_socket_client_connect_async(client, address, connecting,
+			(GAsyncReadyCallback) irc_connected,
+			g_object_ref(connecting));
 
 	return FALSE;
 }
 
-static void irc_connected(GSocketClient *client, GAsyncResult *result,
-		G_GNUC_UNUSED gpointer user_data)
+static gboolean irc_client_setup(void)
 {
 	GError *error = NULL;
+	GTlsCertificateFlags flags = G_TLS_CERTIFICATE_VALIDATE_ALL;
+
+	address = g_network_address_parse(prefs.irc_server,
+			prefs.irc_use_ssl ? 6697 : 6667, &error);
+	if (!address) {
+		g_warning("Invalid IRC server %s: %s", prefs.irc_server,
+				error->message);
+		g_error_free(error);
+		return FALSE;
+	}
 
-	if (reconnect_source > 0) {
-		g_source_remove(reconnect_source);
-		reconnect_source = 0;
+	/* a pinned certificate is trusted by its fingerprint alone */
+	if (!prefs.irc_tls_verify || prefs.irc_tls_fingerprint)
+		flags = 0;
+
+	client = g_socket_client_new();
+	g_socket_client_set_tls(client, prefs.irc_use_ssl);
+	g_socket_client_set_tls_validation_flags(client, flags);
+	g_signal_connect(client, "event", G_CALLBACK(irc_client_event), NULL);
+
+	if (prefs.irc_tls_certificate && *prefs.irc_tls_certificate) {
+		client_cert = g_tls_certificate_new_from_file(
+				prefs.irc_tls_certificate, &error);
+		if (!client_cert) {
+			g_warning("Failed to load TLS certificate: %s",
+					error->message);
+			g_error_free(error);
+		}
 	}
 
-	connection = g_socket_client_connect_finish(client, result, &error);
-	if (!connection) {
+	return TRUE;
+}
+
+static void irc_client_reset(void)
+{
+	if (client)
+		g_object_unref(client);
+	client = NULL;
+	if (address)
+		g_object_unref(address);
+	address = NULL;
+	if (client_cert)
+		g_object_unref(client_cert);
+	client_cert = NULL;
+	if (last_tls)
+		g_object_unref(last_tls);
+	last_tls = NULL;
+}
+
+static void irc_connected(GSocketClient *source, GAsyncResult *result,
+		gpointer user_data)
+{
+	GCancellable *cancellable = user_data;
+	GSocketConnection *conn;
+	GError *error = NULL;
+	gboolean cancelled = g_cancellable_is_cancelled(cancellable);
+
+	if (cancellable == connecting) {
+		g_object_unref(connecting);
+		connecting = NULL;
+	}
+	g_object_unref(cancellable);
+
+	conn = g_socket_client_connect_finish(source, result, &error);
+	if (cancelled) {
+		/* superseded by a newer attempt, or shutting down */
+		if (conn) {
+			g_io_stream_close(G_IO_STREAM(conn), NULL, NULL);
+			g_object_unref(conn);
+		}
+		if (error)
+			g_error_free(error);
+		return;
+	}
+	if (!conn) {
 		g_warning("Failed to connect to IRC: %s", error->message);
 		g_error_free(error);
-		irc_schedule_reconnect();
+		reconnect_failed(&reconnect);
+		return;
+	}
+	connection = conn;
+
+	if (!irc_tls_pinned()) {
+		g_io_stream_close(G_IO_STREAM(connection), NULL, NULL);
+		g_object_unref(connection);
+		connection = NULL;
+		/* never resume a session with the rejected server */
+		if (last_tls)
+			g_object_unref(last_tls);
+		last_tls = NULL;
+		reconnect_failed(&reconnect);
 		return;
 	}
 
@@ -77,14 +217,89 @@ static void irc_connected(GSocketClient *client, GAsyncResult *result,
 	ostream = g_io_stream_get_output_stream(G_IO_STREAM(connection));
 	istream = g_io_stream_get_input_stream(G_IO_STREAM(connection));
 
+	if (readbuf)
+		g_string_truncate(readbuf, 0);
+	else
+		readbuf = g_string_sized_new(IRC_READ_BUF);
+	readbuf_overlong = FALSE;
+
+	/* negotiate capabilities and SASL before registration completes */
+	cap_negotiating = TRUE;
+	sasl_done = FALSE;
+	sasl_requested = FALSE;
+	if (cap_request)
+		g_string_truncate(cap_request, 0);
+	else
+		cap_request = g_string_new(NULL);
+
+	irc_write("CAP LS 302");
+	if (prefs.irc_password && *prefs.irc_password)
+		irc_write("PASS %s", prefs.irc_password);
 	irc_write("NICK %s", prefs.irc_nick);
 	irc_write("USER %s 0 * :%s", prefs.irc_username, prefs.irc_realname);
 
 	irc_source_attach();
 }
 
-static void irc_run(const gchar *command)
+static void irc_client_event(G_GNUC_UNUSED GSocketClient *source,
+		GSocketClientEvent event,
+		G_GNUC_UNUSED GSocketConnectable *connectable,
+		GIOStream *stream, G_GNUC_UNUSED gpointer user_data)
+{
+	if (event == G_SOCKET_CLIENT_TLS_HANDSHAKING) {
+		/* client certificate, used by SASL EXTERNAL */
+		if (client_cert)
+			g_tls_connection_set_certificate(
+					G_TLS_CONNECTION(stream), client_cert);
+		if (last_tls)
+			g_tls_client_connection_copy_session_state(
+					G_TLS_CLIENT_CONNECTION(stream),
+					last_tls);
+	} else if (event == G_SOCKET_CLIENT_TLS_HANDSHAKED) {
+		if (last_tls)
+			g_object_unref(last_tls);
+		last_tls = g_object_ref(G_TLS_CLIENT_CONNECTION(stream));
+	}
+}
+
+/* compares the server certificate against the configured fingerprint */
+static gboolean irc_tls_pinned(void)
 {
+	GIOStream *tls;
+	GTlsCertificate *cert;
+	GByteArray *der;
+	gchar *fingerprint;
+	gboolean match;
+
+	if (!prefs.irc_use_ssl || !prefs.irc_tls_fingerprint)
+		return TRUE;
+
+	tls = g_tcp_wrapper_connection_get_base_io_stream(
+			G_TCP_WRAPPER_CONNECTION(connection));
+	cert = g_tls_connection_get_peer_certificate(G_TLS_CONNECTION(tls));
+	if (!cert)
+		return FALSE;
+
+	g_object_get(cert, "certificate", &der, NULL);
+	fingerprint = g_compute_checksum_for_data(G_CHECKSUM_SHA256,
+			der->data, der->len);
+	match = g_ascii_strcasecmp(fingerprint,
+			prefs.irc_tls_fingerprint) == 0;
+	if (!match)
+		g_warning("IRC server certificate %s doesn't match the "
+				"pinned fingerprint", fingerprint);
+
+	g_free(fingerprint);
+	g_byte_array_unref(der);
+	return match;
+}
+
+static void irc_run(const gchar *nick, const gchar *command)
+{
+	const gchar *args;
+
+	M2I_PROBE2(irc_command, nick, command);
+
 	if (g_ascii_strncasecmp(command, "announce", 8) == 0) {
 		if (prefs.announce)
 			prefs.announce = FALSE;
@@ -93,6 +308,8 @@ static void irc_run(const gchar *command)
 
 		irc_say("New song announcement %sabled",
 				(prefs.announce ? "en" : "dis"));
+	} else if (g_ascii_strncasecmp(command, "like", 4) == 0) {
+		mpd_like(nick);
 	} else if (g_ascii_strncasecmp(command, "next", 4) == 0) {
 		mpd_next();
 	} else if (g_ascii_strncasecmp(command, "np", 2) == 0) {
@@ -107,6 +324,18 @@ static void irc_run(const gchar *command)
 		mpd_random();
 	} else if (g_ascii_strncasecmp(command, "repeat", 6) == 0) {
 		mpd_repeat();
+	} else if (g_ascii_strncasecmp(command, "request", 7) == 0) {
+		args = command + 7;
+		while (*args == ' ')
+			args++;
+		if (*args)
+			mpd_request(nick, args);
+		else
+			irc_say("Usage: !request <query>");
+	} else if (g_ascii_strncasecmp(command, "skipvote", 8) == 0) {
+		mpd_skipvote(nick);
+	} else if (g_ascii_strncasecmp(command, "stats", 5) == 0) {
+		mpd_say_stats();
 	} else if (g_ascii_strncasecmp(command, "status", 6) == 0) {
 		mpd_say_status();
 	} else if (g_ascii_strncasecmp(command, "stop", 4) == 0) {
@@ -114,6 +343,8 @@ static void irc_run(const gchar *command)
 	} else if (g_ascii_strncasecmp(command, "version", 7) == 0) {
 		irc_say("This is " PACKAGE_STRING);
 	}
+
+	M2I_PROBE1(irc_command_done, command);
 }
 
 void irc_say(const gchar *fmt, ...)
@@ -168,65 +399,498 @@ static gboolean irc_callback(G_GNUC_UNUSED GSocket *socket,
 		G_GNUC_UNUSED gpointer user_data)
 {
 	GError *error = NULL;
-	gchar *buf, **lines;
+	gchar *buf, *eol;
 	gssize len;
 
-	buf = g_malloc0(IRC_READ_BUF);
+	buf = g_malloc(IRC_READ_BUF);
 	len = g_input_stream_read(istream, buf, IRC_READ_BUF, NULL, &error);
 	if (len < 0) {
 		g_free(buf);
 		g_warning("Failed to read from IRC: %s", error->message);
 		g_error_free(error);
-		irc_schedule_reconnect();
+		irc_connection_lost();
+		return FALSE;
+	} else if (len == 0) {
+		g_free(buf);
+		g_warning("IRC server closed the connection");
+		irc_connection_lost();
 		return FALSE;
-	} else if (len > 0) {
-		lines = g_strsplit(buf, "\r\n", 0);
-		for (guint i = 0; lines[i] != NULL; i++)
-			irc_parse(lines[i]);
-		g_strfreev(lines);
+	} else {
+		/* lines may be split across reads, keep the remainder */
+		g_string_append_len(readbuf, buf, len);
+		while ((eol = memchr(readbuf->str, '\n', readbuf->len)) !=
+				NULL) {
+			/* the tail of a line that was already dropped */
+			if (readbuf_overlong) {
+				readbuf_overlong = FALSE;
+				g_string_erase(readbuf, 0,
+						eol - readbuf->str + 1);
+				continue;
+			}
+			*eol = '\0';
+			if (eol > readbuf->str && eol[-1] == '\r')
+				eol[-1] = '\0';
+			M2I_PROBE1(irc_line, readbuf->str);
+			capture_irc(readbuf->str);
+			irc_parse(readbuf->str);
+			g_string_erase(readbuf, 0, eol - readbuf->str + 1);
+		}
+
+		/* don't buffer a line that never ends */
+		if (readbuf->len > IRC_MAX_LINE) {
+			if (!readbuf_overlong)
+				g_warning("Dropping overlong line from IRC");
+			readbuf_overlong = TRUE;
+			g_string_truncate(readbuf, 0);
+		}
 	}
 	g_free(buf);
 
 	return TRUE;
 }
 
-static void irc_parse(const gchar *buffer)
+void irc_parse(const gchar *buffer)
 {
 	/* TODO:
-	 * ERROR: Closing Link
 	 * die <die password>
 	 */
-	gchar *tmp;
+	struct irc_message msg;
+	gchar *line = g_strdup(buffer), *nick;
 
-	if (!connected) {
-		tmp = g_strdup_printf(" 001 %s :", prefs.irc_nick);
-		if (strstr(buffer, tmp)) {
-			irc_write("JOIN %s", prefs.irc_channel);
-			connected = TRUE;
+	M2I_PROBE1(irc_parse, buffer);
+	if (!irc_message_parse(line, &msg)) {
+		g_free(line);
+		return;
+	}
+	M2I_PROBE2(irc_dispatch, msg.command, msg.nparams);
+
+	if (strcmp(msg.command, "BATCH") == 0) {
+		irc_batch(&msg);
+	} else if (irc_batch_skipped(&msg)) {
+		/* part of a netsplit or netjoin */
+	} else if (strcmp(msg.command, "PING") == 0 && msg.nparams > 0) {
+		irc_write("PONG :%s", msg.params[0]);
+	} else if (strcmp(msg.command, "CAP") == 0) {
+		irc_cap(&msg);
+	} else if (strcmp(msg.command, "AUTHENTICATE") == 0 &&
+			msg.nparams > 0) {
+		irc_sasl_authenticate(msg.params[0]);
+	} else if (strcmp(msg.command, "903") == 0) {
+		g_message("SASL authentication successful");
+		sasl_done = TRUE;
+		sasl_requested = FALSE;
+		irc_cap_end();
+	} else if (irc_sasl_failed(msg.command)) {
+		g_warning("SASL authentication failed: %s",
+				msg.nparams > 0 ?
+				msg.params[msg.nparams - 1] : msg.command);
+		sasl_requested = FALSE;
+		irc_cap_end();
+	} else if (strcmp(msg.command, "001") == 0) {
+		if (!connected)
+			irc_registered();
+	} else if (strcmp(msg.command, "JOIN") == 0 && msg.nparams > 0) {
+		if (prefs.irc_channel && irc_message_from_self(&msg) &&
+				g_ascii_strcasecmp(msg.params[0],
+					prefs.irc_channel) == 0)
+			notify_up(NOTIFY_IRC);
+	} else if (strcmp(msg.command, "PRIVMSG") == 0 && msg.nparams == 2) {
+		if (prefs.irc_channel && msg.prefix &&
+				!irc_message_from_self(&msg) &&
+				g_ascii_strcasecmp(msg.params[0],
+					prefs.irc_channel) == 0 &&
+				msg.params[1][0] == '!') {
+			nick = g_strndup(msg.prefix,
+					strcspn(msg.prefix, "!@"));
+			irc_run(nick, msg.params[1] + 1);
+			g_free(nick);
+		}
+	} else if (strcmp(msg.command, "ERROR") == 0 && msg.nparams > 0) {
+		g_warning("IRC server error: %s", msg.params[0]);
+	}
+
+	M2I_PROBE1(irc_dispatch_done, msg.command);
+	g_free(line);
+}
+
+/* splits a line into tags, prefix, command and params, in place */
+static gboolean irc_message_parse(gchar *line, struct irc_message *msg)
+{
+	memset(msg, 0, sizeof(*msg));
+
+	if (*line == '@') {
+		msg->tags = line + 1;
+		if (!(line = strchr(line, ' ')))
+			return FALSE;
+		*line++ = '\0';
+		while (*line == ' ')
+			line++;
+	}
+
+	if (*line == ':') {
+		msg->prefix = line + 1;
+		if (!(line = strchr(line, ' ')))
+			return FALSE;
+		*line++ = '\0';
+		while (*line == ' ')
+			line++;
+	}
+
+	msg->command = line;
+	line = strchr(line, ' ');
+	while (line && msg->nparams < IRC_MAX_PARAMS) {
+		*line++ = '\0';
+		while (*line == ' ')
+			line++;
+		if (*line == '\0')
+			break;
+		if (*line == ':') {
+			msg->params[msg->nparams++] = line + 1;
+			break;
 		}
-		g_free(tmp);
+		msg->params[msg->nparams++] = line;
+		line = strchr(line, ' ');
 	}
 
-	if (strstr(buffer, "PING :")) {
-		irc_write("PONG :%s", strstr(buffer, "PING :") + 6);
+	return *msg->command != '\0';
+}
+
+/* returns the raw value of a message tag, or NULL if it isn't present */
+static gchar *irc_message_get_tag(const struct irc_message *msg,
+		const gchar *key)
+{
+	const gsize len = strlen(key);
+	gchar **tags, *value = NULL;
+
+	if (!msg->tags)
+		return NULL;
+
+	tags = g_strsplit(msg->tags, ";", 0);
+	for (guint i = 0; tags[i] && !value; i++) {
+		if (strncmp(tags[i], key, len) != 0)
+			continue;
+		if (tags[i][len] == '=')
+			value = g_strdup(tags[i] + len + 1);
+		else if (tags[i][len] == '\0')
+			value = g_strdup("");
 	}
+	g_strfreev(tags);
 
-	tmp = g_strdup_printf("PRIVMSG %s :!", prefs.irc_channel);
-	if (strstr(buffer, tmp))
-		irc_run(strstr(buffer, tmp) + strlen(tmp));
-	g_free(tmp);
+	return value;
+}
+
+/* tracks the type of open batches: BATCH +ref type, BATCH -ref */
+static void irc_batch(const struct irc_message *msg)
+{
+	const gchar *ref;
+
+	if (msg->nparams < 1)
+		return;
+	ref = msg->params[0];
+
+	if (!batches)
+		batches = g_hash_table_new_full(g_str_hash, g_str_equal,
+				g_free, g_free);
+
+	if (ref[0] == '+' && msg->nparams > 1)
+		g_hash_table_insert(batches, g_strdup(ref + 1),
+				g_strdup(msg->params[1]));
+	else if (ref[0] == '-')
+		g_hash_table_remove(batches, ref + 1);
+}
+
+/*
+ * Netsplits and netjoins arrive as batches of QUITs and JOINs, none of
+ * which we act on, so they are skipped as a unit.  Messages in any other
+ * batch (multiline, playback, ...) are handled like all others.
+ */
+static gboolean irc_batch_skipped(const struct irc_message *msg)
+{
+	gchar *ref = irc_message_get_tag(msg, "batch");
+	const gchar *type = NULL;
+
+	if (!ref)
+		return FALSE;
+
+	if (batches)
+		type = g_hash_table_lookup(batches, ref);
+	g_free(ref);
+
+	return type && (strcmp(type, "netsplit") == 0 ||
+			strcmp(type, "netjoin") == 0);
+}
+
+/* with echo-message our own messages come back to us */
+static gboolean irc_message_from_self(const struct irc_message *msg)
+{
+	gsize len;
+
+	if (!msg->prefix || !prefs.irc_nick)
+		return FALSE;
+
+	len = strcspn(msg->prefix, "!@");
+	return len == strlen(prefs.irc_nick) &&
+		g_ascii_strncasecmp(msg->prefix, prefs.irc_nick, len) == 0;
+}
+
+static void irc_cap(const struct irc_message *msg)
+{
+	const gchar *caps;
+	gchar **list;
+
+	if (msg->nparams < 3)
+		return;
+	caps = msg->params[msg->nparams - 1];
+	if (!cap_request)
+		cap_request = g_string_new(NULL);
+
+	if (strcmp(msg->params[1], "LS") == 0) {
+		list = g_strsplit(caps, " ", 0);
+		for (guint i = 0; list[i]; i++) {
+			if (!irc_cap_wanted(list[i]))
+				continue;
+			if (cap_request->len > 0)
+				g_string_append_c(cap_request, ' ');
+			g_string_append_len(cap_request, list[i],
+					strcspn(list[i], "="));
+		}
+		g_strfreev(list);
+
+		/* "CAP * LS * :..." means more lines follow */
+		if (msg->nparams > 3 && strcmp(msg->params[2], "*") == 0)
+			return;
+
+		if (cap_request->len > 0)
+			irc_write("CAP REQ :%s", cap_request->str);
+		else
+			irc_cap_end();
+	} else if (strcmp(msg->params[1], "ACK") == 0) {
+		if (prefs.irc_sasl_mechanism && irc_cap_listed(caps, "sasl")) {
+			irc_write("AUTHENTICATE %s",
+					prefs.irc_sasl_mechanism);
+			sasl_requested = TRUE;
+		} else {
+			irc_cap_end();
+		}
+	} else if (strcmp(msg->params[1], "NAK") == 0) {
+		g_warning("IRC server rejected capabilities: %s", caps);
+		irc_cap_end();
+	}
+}
+
+static gboolean irc_cap_wanted(const gchar *cap)
+{
+	const gsize len = strcspn(cap, "=");
+	gboolean found = FALSE;
+	gchar **mechs;
+
+	if (len == 4 && strncmp(cap, "sasl", 4) == 0) {
+		if (!prefs.irc_sasl_mechanism)
+			return FALSE;
+		/* CAP 302 servers list the mechanisms they support */
+		if (cap[len] != '=')
+			return TRUE;
+
+		mechs = g_strsplit(cap + len + 1, ",", 0);
+		for (guint i = 0; mechs[i] && !found; i++)
+			found = g_ascii_strcasecmp(mechs[i],
+					prefs.irc_sasl_mechanism) == 0;
+		g_strfreev(mechs);
+
+		if (!found)
+			g_warning("IRC server doesn't support SASL %s",
+					prefs.irc_sasl_mechanism);
+		return found;
+	}
+
+	for (guint i = 0; i < G_N_ELEMENTS(irc_caps); i++)
+		if (len == strlen(irc_caps[i]) &&
+				strncmp(cap, irc_caps[i], len) == 0)
+			return TRUE;
+
+	return FALSE;
+}
+
+static gboolean irc_cap_listed(const gchar *caps, const gchar *cap)
+{
+	gchar **list = g_strsplit(caps, " ", 0);
+	gboolean found = FALSE;
+
+	for (guint i = 0; list[i] && !found; i++)
+		found = strcmp(list[i], cap) == 0;
+	g_strfreev(list);
+
+	return found;
+}
+
+static void irc_cap_end(void)
+{
+	if (!cap_negotiating)
+		return;
+
+	irc_write("CAP END");
+	cap_negotiating = FALSE;
+}
+
+static void irc_sasl_authenticate(const gchar *challenge)
+{
+	const gchar *user;
+	GString *payload;
+	gchar *encoded;
+	gsize len;
+
+	/* only answer an exchange we started, never an unsolicited one */
+	if (!sasl_requested || !cap_negotiating || !prefs.irc_sasl_mechanism)
+		return;
+
+	/* PLAIN and EXTERNAL both start with an empty challenge */
+	if (strcmp(challenge, "+") != 0)
+		return;
+
+	/* EXTERNAL uses the TLS client certificate and sends nothing */
+	payload = g_string_new(NULL);
+	if (strcmp(prefs.irc_sasl_mechanism, "PLAIN") == 0) {
+		user = prefs.irc_sasl_username && *prefs.irc_sasl_username ?
+			prefs.irc_sasl_username : prefs.irc_nick;
+		g_string_append(payload, user);
+		g_string_append_c(payload, '\0');
+		g_string_append(payload, user);
+		g_string_append_c(payload, '\0');
+		if (prefs.irc_sasl_password)
+			g_string_append(payload, prefs.irc_sasl_password);
+	}
+
+	encoded = g_base64_encode((const guchar *) payload->str, payload->len);
+	len = strlen(encoded);
+	for (gsize off = 0; off < len; off += IRC_SASL_CHUNK)
+		irc_write("AUTHENTICATE %.*s", IRC_SASL_CHUNK, encoded + off);
+	if (len % IRC_SASL_CHUNK == 0)
+		irc_write("AUTHENTICATE +");
+
+	g_free(encoded);
+	g_string_free(payload, TRUE);
+}
+
+static gboolean irc_sasl_failed(const gchar *numeric)
+{
+	const gchar *failures[] = { "902", "904", "905", "906", "907" };
+
+	for (guint i = 0; i < G_N_ELEMENTS(failures); i++)
+		if (strcmp(numeric, failures[i]) == 0)
+			return TRUE;
+
+	return FALSE;
+}
+
+static void irc_registered(void)
+{
+	/* fall back to a services bot if SASL didn't log us in */
+	if (!sasl_done && prefs.irc_auth_serv && prefs.irc_auth_string)
+		irc_write("PRIVMSG %s :%s", prefs.irc_auth_serv,
+				prefs.irc_auth_string);
+
+	irc_write("JOIN %s", prefs.irc_channel);
+	connected = TRUE;
+	reconnect_done(&reconnect);
+}
+
+/* reconnects or rejoins only where the new settings require it */
+void irc_reload(const struct preferences *old)
+{
+	if (g_strcmp0(old->irc_server, prefs.irc_server) != 0 ||
+			old->irc_use_ssl != prefs.irc_use_ssl ||
+			g_strcmp0(old->irc_password, prefs.irc_password) != 0 ||
+			g_strcmp0(old->irc_username, prefs.irc_username) != 0 ||
+			g_strcmp0(old->irc_realname, prefs.irc_realname) != 0 ||
+			g_strcmp0(old->irc_tls_certificate,
+				prefs.irc_tls_certificate) != 0 ||
+			g_strcmp0(old->irc_sasl_mechanism,
+				prefs.irc_sasl_mechanism) != 0 ||
+			g_strcmp0(old->irc_sasl_username,
+				prefs.irc_sasl_username) != 0 ||
+			g_strcmp0(old->irc_sasl_password,
+				prefs.irc_sasl_password) != 0 ||
+			old->irc_tls_verify != prefs.irc_tls_verify ||
+			g_strcmp0(old->irc_tls_fingerprint,
+				prefs.irc_tls_fingerprint) != 0) {
+		g_message("IRC connection settings changed, reconnecting");
+		irc_write("QUIT :Reconnecting");
+		irc_disconnect();
+		irc_client_reset();
+		reconnect_cancel(&reconnect);
+		irc_connect(NULL);
+		return;
+	}
+
+	if (!connected)
+		return;
+
+	if (g_strcmp0(old->irc_nick, prefs.irc_nick) != 0)
+		irc_write("NICK %s", prefs.irc_nick);
+
+	if (g_strcmp0(old->irc_channel, prefs.irc_channel) != 0) {
+		if (old->irc_channel)
+			irc_write("PART %s", old->irc_channel);
+		if (prefs.irc_channel)
+			irc_write("JOIN %s", prefs.irc_channel);
+	}
 }
 
 void irc_cleanup(void)
 {
-	if (connection)
+	if (connecting) {
+		g_cancellable_cancel(connecting);
+		g_object_unref(connecting);
+	}
+	connecting = NULL;
+
+	reconnect_cancel(&reconnect);
+	irc_disconnect();
+	irc_client_reset();
+	if (readbuf)
+		g_string_free(readbuf, TRUE);
+	readbuf = NULL;
+	if (cap_request)
+		g_string_free(cap_request, TRUE);
+	cap_request = NULL;
+	if (batches)
+		g_hash_table_destroy(batches);
+	batches = NULL;
+}
+
+static void irc_disconnect(void)
+{
+	if (callback_source) {
+		g_source_destroy(callback_source);
+		g_source_unref(callback_source);
+	}
+	callback_source = NULL;
+
+	/*
+	 * last_tls still references the TLS stream to resume its session,
+	 * so the socket has to be closed explicitly
+	 */
+	if (connection) {
+		g_io_stream_close(G_IO_STREAM(connection), NULL, NULL);
 		g_object_unref(connection);
+	}
+	connection = NULL;
 	istream = NULL;
 	ostream = NULL;
-	g_source_unref(callback_source);
+	connected = FALSE;
+	if (batches)
+		g_hash_table_remove_all(batches);
+	notify_down(NOTIFY_IRC);
 }
 
-static void irc_schedule_reconnect(void)
+/* a drop before registration completed counts as a failed attempt */
+static void irc_connection_lost(void)
 {
-	reconnect_source = g_timeout_add_seconds(30, irc_connect, NULL);
+	gboolean registered = connected;
+
+	irc_disconnect();
+	if (registered)
+		reconnect_lost(&reconnect);
+	else
+		reconnect_failed(&reconnect);
 }
@@ -9,8 +9,12 @@
 #ifndef HAVE_IRC_H
 #define HAVE_IRC_H
 
+struct preferences;
+
 gboolean irc_connect(G_GNUC_UNUSED gpointer data);
 void irc_say(const gchar *msg, ...);
+void irc_parse(const gchar *buffer);
+void irc_reload(const struct preferences *old);
 void irc_cleanup(void);
 
 #endif /* HAVE_IRC_H */
@@ -0,0 +1,492 @@
+/*
+ * mpd2irc - MPD->IRC gateway
+ *
+ * Copyright 2008-2011 Christoph Mende
+ * All rights reserved. Released under the 2-clause BSD license.
+ */
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+#include "log.h"
+
+/*
+ * Log messages are formatted into a fixed ring of slots and written out
+ * by a flusher thread, so g_warning() and friends never block the main
+ * loop on a slow terminal, file or journal.  Writers claim a slot with an
+ * atomic increment and publish it through the slot's sequence number, the
+ * flusher copies a slot and checks the number again (a seqlock), so
+ * neither side takes a lock.  A flusher more than a ring behind loses the
+ * oldest messages.  Every call site may log LOG_BURST messages per
+ * LOG_WINDOW seconds, further ones are counted and reported with the next
+ * message that gets through.  Call sites are told apart by file and line
+ * in an open addressing table, so a storm at one never silences another.
+ */
+
+#define LOG_TEXT_MAX		480
+#define LOG_SITES		256
+#define LOG_SITE_KEY		96
+#define LOG_FLUSH_INTERVAL	100000	/* us */
+
+struct log_slot {
+	/* ticket + 1 once written, 0 while being written */
+	gint seq;
+	GLogLevelFlags level;
+	gint64 time;
+	gchar text[LOG_TEXT_MAX];
+};
+
+struct log_site {
+	/* set once and for all, the key is valid when LOG_SITE_READY */
+	gint state;
+	gchar key[LOG_SITE_KEY];
+	gint window;
+	gint count;
+	gint suppressed;
+};
+
+enum log_site_state {
+	LOG_SITE_FREE,
+	LOG_SITE_CLAIMED,
+	LOG_SITE_READY
+};
+
+enum log_output {
+	LOG_STDERR,
+	LOG_FILE,
+	LOG_JOURNAL
+};
+
+enum log_slot_state {
+	LOG_SLOT_OK,
+	LOG_SLOT_BUSY,
+	LOG_SLOT_LOST
+};
+
+static GLogWriterOutput log_writer(GLogLevelFlags level,
+		const GLogField *fields, gsize n_fields, gpointer data);
+static struct log_site *log_get_site(const gchar *file, const gchar *line,
+		const gchar *domain);
+static gsize log_append(gchar *buffer, gsize pos, const gchar *fmt, ...)
+	G_GNUC_PRINTF(3, 4);
+static gpointer log_flush_thread(gpointer data);
+static void log_drain(void);
+static enum log_slot_state log_read(guint ticket, struct log_slot *copy);
+static void log_write(FILE *fp, enum log_output target,
+		const struct log_slot *entry);
+static void log_write_dump(void);
+static FILE *log_open(const gchar *path, enum log_output *target);
+static gchar *log_dump_path(const gchar *dump_path);
+
+static struct log_slot ring[LOG_RING_SIZE];
+static struct log_site sites[LOG_SITES];
+/* shared by the sites that don't fit into the table */
+static struct log_site overflow;
+/* the next ticket to hand out, and the next one to be flushed */
+static gint head = 0;
+static guint tail = 0;
+static guint lost = 0;
+
+static gint running = FALSE;
+static gint dump_requested = FALSE;
+static gboolean installed = FALSE;
+static gboolean debug = FALSE;
+static GThread *flusher = NULL;
+/* out, output and dump_file change on reload, the writers never use them */
+static GMutex output_lock;
+static FILE *out = NULL;
+static enum log_output output = LOG_STDERR;
+static gchar *dump_file = NULL;
+
+/* routes all logging through the ring, path NULL logs to stderr/journald */
+void log_init(const gchar *path, const gchar *dump_path)
+{
+	out = log_open(path, &output);
+	if (!out)
+		out = log_open(NULL, &output);
+	dump_file = log_dump_path(dump_path);
+	debug = g_getenv("G_MESSAGES_DEBUG") != NULL;
+
+	g_atomic_int_set(&running, TRUE);
+	flusher = g_thread_new("log", log_flush_thread, NULL);
+
+	/* can only be done once per process */
+	if (!installed) {
+		g_log_set_writer_func(log_writer, NULL, NULL);
+		installed = TRUE;
+	}
+}
+
+/*
+ * Reopens the log file, which also picks up a file moved away by
+ * logrotate.  If the new one can't be opened the old one is kept.
+ */
+void log_reload(const gchar *path, const gchar *dump_path)
+{
+	enum log_output target, previous;
+	FILE *fp, *old;
+	gchar *old_dump;
+
+	fp = log_open(path, &target);
+	if (!fp)
+		return;
+
+	g_mutex_lock(&output_lock);
+	old = out;
+	previous = output;
+	out = fp;
+	output = target;
+	old_dump = dump_file;
+	dump_file = log_dump_path(dump_path);
+	g_mutex_unlock(&output_lock);
+
+	if (previous == LOG_FILE)
+		fclose(old);
+	g_free(old_dump);
+}
+
+/* writes the recent messages to the dump file, off the main loop */
+void log_dump(void)
+{
+	if (g_atomic_int_get(&running))
+		g_atomic_int_set(&dump_requested, TRUE);
+}
+
+void log_cleanup(void)
+{
+	if (!flusher)
+		return;
+
+	/* from here on messages are written synchronously again */
+	g_atomic_int_set(&running, FALSE);
+	g_thread_join(flusher);
+	flusher = NULL;
+	log_drain();
+
+	if (output == LOG_FILE)
+		fclose(out);
+	out = NULL;
+	g_free(dump_file);
+	dump_file = NULL;
+}
+
+static GLogWriterOutput log_writer(GLogLevelFlags level,
+		const GLogField *fields, gsize n_fields, gpointer data)
+{
+	const gchar *message = "", *file = NULL, *line = NULL, *domain = NULL;
+	struct log_site *site;
+	struct log_slot *slot;
+	gint window, old, suppressed;
+	guint ticket;
+	gsize pos;
+
+	/* fatal messages have to be out before we abort */
+	if (!g_atomic_int_get(&running) ||
+			(level & (G_LOG_FLAG_FATAL | G_LOG_LEVEL_ERROR)))
+		return g_log_writer_default(level, fields, n_fields, data);
+
+	if ((level & (G_LOG_LEVEL_INFO | G_LOG_LEVEL_DEBUG)) && !debug)
+		return G_LOG_WRITER_HANDLED;
+
+	for (gsize i = 0; i < n_fields; i++) {
+		if (fields[i].length >= 0)
+			continue;
+		if (strcmp(fields[i].key, "MESSAGE") == 0)
+			message = fields[i].value;
+		else if (strcmp(fields[i].key, "CODE_FILE") == 0)
+			file = fields[i].value;
+		else if (strcmp(fields[i].key, "CODE_LINE") == 0)
+			line = fields[i].value;
+		else if (strcmp(fields[i].key, "GLIB_DOMAIN") == 0)
+			domain = fields[i].value;
+	}
+
+	/* rate limit the call site */
+	site = log_get_site(file, line, domain);
+	window = g_get_monotonic_time() / (LOG_WINDOW * G_USEC_PER_SEC);
+	old = g_atomic_int_get(&site->window);
+	if (old != window && g_atomic_int_compare_and_exchange(&site->window,
+				old, window))
+		g_atomic_int_set(&site->count, 0);
+	if (g_atomic_int_add(&site->count, 1) >= LOG_BURST) {
+		g_atomic_int_inc(&site->suppressed);
+		return G_LOG_WRITER_HANDLED;
+	}
+	do {
+		suppressed = g_atomic_int_get(&site->suppressed);
+	} while (suppressed > 0 && !g_atomic_int_compare_and_exchange(
+				&site->suppressed, suppressed, 0));
+
+	/* a slot's sequence number must never be 0 once written */
+	do {
+		ticket = (guint) g_atomic_int_add(&head, 1);
+	} while (ticket + 1 == 0);
+
+	slot = &ring[ticket % LOG_RING_SIZE];
+	g_atomic_int_set(&slot->seq, 0);
+	slot->level = level;
+	slot->time = g_get_real_time();
+	pos = 0;
+	if (domain)
+		pos = log_append(slot->text, pos, "%s: ", domain);
+	if (file && line)
+		pos = log_append(slot->text, pos, "%s:%s: ", file, line);
+	pos = log_append(slot->text, pos, "%s", message);
+	if (suppressed > 0)
+		log_append(slot->text, pos, " (%d similar messages "
+				"suppressed)", suppressed);
+	g_atomic_int_set(&slot->seq, (gint) (ticket + 1));
+
+	return G_LOG_WRITER_HANDLED;
+}
+
+/*
+ * Looks the call site up by linear probing, claiming a free entry for a
+ * new one.  Entries are never released, so no lock is needed.
+ */
+static struct log_site *log_get_site(const gchar *file, const gchar *line,
+		const gchar *domain)
+{
+	gchar key[LOG_SITE_KEY];
+	struct log_site *site;
+	guint hash;
+
+	if (file && line)
+		g_snprintf(key, sizeof(key), "%s:%s", file, line);
+	else
+		g_strlcpy(key, domain ? domain : "", sizeof(key));
+	hash = g_str_hash(key);
+
+	for (guint i = 0; i < LOG_SITES; i++) {
+		site = &sites[(hash + i) % LOG_SITES];
+		if (g_atomic_int_compare_and_exchange(&site->state,
+					LOG_SITE_FREE, LOG_SITE_CLAIMED)) {
+			g_strlcpy(site->key, key, sizeof(site->key));
+			g_atomic_int_set(&site->state, LOG_SITE_READY);
+			return site;
+		}
+
+		/* another thread is just filling in its key */
+		while (g_atomic_int_get(&site->state) != LOG_SITE_READY)
+			g_thread_yield();
+		if (strcmp(site->key, key) == 0)
+			return site;
+	}
+
+	return &overflow;
+}
+
+/* appends to a slot's text, truncating at LOG_TEXT_MAX */
+static gsize log_append(gchar *buffer, gsize pos, const gchar *fmt, ...)
+{
+	va_list ap;
+	gint len;
+
+	if (pos >= LOG_TEXT_MAX - 1)
+		return pos;
+
+	va_start(ap, fmt);
+	len = g_vsnprintf(buffer + pos, LOG_TEXT_MAX - pos, fmt, ap);
+	va_end(ap);
+
+	return MIN(pos + MAX(len, 0), LOG_TEXT_MAX - 1);
+}
+
+static gpointer log_flush_thread(G_GNUC_UNUSED gpointer data)
+{
+	while (g_atomic_int_get(&running)) {
+		log_drain();
+		if (g_atomic_int_compare_and_exchange(&dump_requested, TRUE,
+					FALSE)) {
+			g_mutex_lock(&output_lock);
+			log_write_dump();
+			g_mutex_unlock(&output_lock);
+		}
+		g_usleep(LOG_FLUSH_INTERVAL);
+	}
+	return NULL;
+}
+
+/* writes out everything published since the last call */
+static void log_drain(void)
+{
+	struct log_slot entry;
+	guint h;
+
+	g_mutex_lock(&output_lock);
+	for (;;) {
+		h = (guint) g_atomic_int_get(&head);
+		if (tail == h)
+			break;
+
+		if (h - tail > LOG_RING_SIZE) {
+			lost += h - tail - LOG_RING_SIZE;
+			tail = h - LOG_RING_SIZE;
+		}
+		if (tail + 1 == 0) {
+			tail++;
+			continue;
+		}
+
+		switch (log_read(tail, &entry)) {
+			case LOG_SLOT_OK:
+				if (lost > 0) {
+					fprintf(out, "%u log messages lost\n",
+							lost);
+					lost = 0;
+				}
+				log_write(out, output, &entry);
+				break;
+			case LOG_SLOT_LOST:
+				lost++;
+				break;
+			case LOG_SLOT_BUSY:
+				/* try again with the next flush */
+				fflush(out);
+				g_mutex_unlock(&output_lock);
+				return;
+		}
+		tail++;
+	}
+
+	fflush(out);
+	g_mutex_unlock(&output_lock);
+}
+
+static enum log_slot_state log_read(guint ticket, struct log_slot *copy)
+{
+	struct log_slot *slot = &ring[ticket % LOG_RING_SIZE];
+	guint seq = (guint) g_atomic_int_get(&slot->seq);
+
+	if (seq != ticket + 1) {
+		/* claimed, but not written yet */
+		if (seq == 0 || seq == ticket + 1 - LOG_RING_SIZE)
+			return LOG_SLOT_BUSY;
+		return LOG_SLOT_LOST;
+	}
+
+	memcpy(copy, slot, sizeof(*copy));
+
+	/* overwritten while copying */
+	if ((guint) g_atomic_int_get(&slot->seq) != seq)
+		return LOG_SLOT_LOST;
+	return LOG_SLOT_OK;
+}
+
+static void log_write(FILE *fp, enum log_output target,
+		const struct log_slot *entry)
+{
+	const gchar *name, *priority;
+	GDateTime *date;
+	gchar *stamp;
+
+	if (entry->level & G_LOG_LEVEL_ERROR) {
+		name = "ERROR";
+		priority = "3";
+	} else if (entry->level & G_LOG_LEVEL_CRITICAL) {
+		name = "CRITICAL";
+		priority = "4";
+	} else if (entry->level & G_LOG_LEVEL_WARNING) {
+		name = "WARNING";
+		priority = "4";
+	} else if (entry->level & G_LOG_LEVEL_MESSAGE) {
+		name = "Message";
+		priority = "5";
+	} else if (entry->level & G_LOG_LEVEL_INFO) {
+		name = "INFO";
+		priority = "6";
+	} else {
+		name = "DEBUG";
+		priority = "7";
+	}
+
+	if (target == LOG_JOURNAL) {
+		const GLogField fields[] = {
+			{ "MESSAGE", entry->text, -1 },
+			{ "PRIORITY", priority, -1 },
+			{ "SYSLOG_IDENTIFIER", "mpd2irc", -1 },
+		};
+
+		if (g_log_writer_journald(entry->level, fields,
+					G_N_ELEMENTS(fields), NULL) ==
+				G_LOG_WRITER_HANDLED)
+			return;
+	}
+
+	date = g_date_time_new_from_unix_local(entry->time / G_USEC_PER_SEC);
+	stamp = g_date_time_format(date, "%Y-%m-%d %H:%M:%S");
+	fprintf(fp, "%s.%03u %s: %s\n", stamp,
+			(guint) (entry->time % G_USEC_PER_SEC / 1000), name,
+			entry->text);
+	g_free(stamp);
+	g_date_time_unref(date);
+}
+
+/* writes whatever the ring still holds, flushed or not */
+static void log_write_dump(void)
+{
+	struct log_slot entry;
+	FILE *fp;
+	guint h, count = 0;
+	gint fd;
+
+	/* never follow a link someone else planted there */
+	fd = open(dump_file, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW |
+			O_CLOEXEC, 0600);
+	if (fd < 0 || !(fp = fdopen(fd, "w"))) {
+		g_warning("Failed to open %s: %s", dump_file,
+				g_strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return;
+	}
+
+	h = (guint) g_atomic_int_get(&head);
+	for (guint ticket = h - LOG_RING_SIZE; ticket != h; ticket++) {
+		if (log_read(ticket, &entry) == LOG_SLOT_OK) {
+			log_write(fp, LOG_FILE, &entry);
+			count++;
+		}
+	}
+	fclose(fp);
+
+	g_message("Dumped %u log messages to %s", count, dump_file);
+}
+
+/* opens path for appending, or picks stderr or the journal without one */
+static FILE *log_open(const gchar *path, enum log_output *target)
+{
+	FILE *fp;
+
+	if (!path) {
+		*target = g_log_writer_is_journald(fileno(stderr)) ?
+			LOG_JOURNAL : LOG_STDERR;
+		return stderr;
+	}
+
+	fp = fopen(path, "a");
+	if (!fp) {
+		g_warning("Failed to open log file %s: %s", path,
+				g_strerror(errno));
+		return NULL;
+	}
+
+	*target = LOG_FILE;
+	return fp;
+}
+
+static gchar *log_dump_path(const gchar *dump_path)
+{
+	if (dump_path)
+		return g_strdup(dump_path);
+
+	return g_build_filename(g_get_user_runtime_dir(), "mpd2irc.dump",
+			NULL);
+}
@@ -0,0 +1,21 @@
+/*
+ * mpd2irc - MPD->IRC gateway
+ *
+ * Copyright 2008-2011 Christoph Mende
+ * All rights reserved. Released under the 2-clause BSD license.
+ */
+
+
+#ifndef HAVE_LOG_H
+#define HAVE_LOG_H
+
+#define LOG_RING_SIZE		1024
+#define LOG_BURST		10
+#define LOG_WINDOW		10	/* s */
+
+void log_init(const gchar *path, const gchar *dump_path);
+void log_reload(const gchar *path, const gchar *dump_path);
+void log_dump(void);
+void log_cleanup(void);
+
+#endif /* HAVE_LOG_H */
@@ -12,14 +12,19 @@
 #include <glib.h>
 #include <glib-object.h>
 
+#include "capture.h"
 #include "irc.h"
+#include "log.h"
 #include "mpd.h"
+#include "notify.h"
 #include "preferences.h"
+#include "timer.h"
 
 static void m2i_sighandler(gint sig);
 static void m2i_open_signal_pipe(void);
 static gboolean m2i_signal_parse(GIOChannel *source, GIOCondition condition,
 		gpointer data);
+static void m2i_reload(void);
 static void m2i_cleanup(void);
 static void m2i_fork(void);
 
@@ -34,15 +39,32 @@ int main(int argc, char *argv[])
 	/* initialize the gobject typing system */
 	g_type_init();
 
+	/* parse cli */
+	parse_args(argc, argv);
+
 	/* parse config */
 	parse_config();
 
-	/* parse cli */
-	parse_args(argc, argv);
+	/* feed a capture through the parsers instead of connecting */
+	if (prefs.replay_file) {
+		gboolean success;
+
+		timer_set_virtual(TRUE);
+		g_random_set_seed(0);
+		success = capture_replay(prefs.replay_file,
+				prefs.replay_realtime);
+		timer_cleanup();
+		prefs_cleanup();
+		return success ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
 
-	if (!prefs.foreground)
+	/* a supervising service manager wants us in the foreground */
+	if (!notify_init() && !prefs.foreground)
 		m2i_fork();
 
+	/* threads do not survive the fork, start logging after it */
+	log_init(prefs.log_file, prefs.log_dump);
+
 	/* set up sighandler */
 	m2i_open_signal_pipe();
 	sa.sa_handler = m2i_sighandler;
@@ -51,12 +73,14 @@ int main(int argc, char *argv[])
 	sigaction(SIGINT, &sa, NULL);
 	sigaction(SIGTERM, &sa, NULL);
 	sigaction(SIGQUIT, &sa, NULL);
+	sigaction(SIGHUP, &sa, NULL);
+	sigaction(SIGUSR1, &sa, NULL);
 
-	/* connect to mpd */
-	if (!mpd_connect())
-		mpd_schedule_reconnect();
+	if (prefs.capture_file)
+		capture_open(prefs.capture_file);
 
-	/* connect to irc */
+	/* connect to mpd and irc concurrently */
+	mpd_connect();
 	irc_connect(NULL);
 
 	/* set up events */
@@ -83,8 +107,11 @@ static void m2i_cleanup(void)
 	prefs_cleanup();
 	irc_cleanup();
 	mpd_cleanup();
+	capture_close();
+	notify_cleanup();
 
 	g_source_remove(signal_source);
+	log_cleanup();
 }
 
 static void m2i_open_signal_pipe(void)
@@ -105,9 +132,13 @@ static gboolean m2i_signal_parse(GIOChannel *source,
 		G_GNUC_UNUSED gpointer data)
 {
 	gint fd = g_io_channel_unix_get_fd(source);
-	gushort sig;
+	guchar sig;
 	if (read(fd, &sig, 1) < 0) {
 		/* TODO */
+	} else if (sig == SIGHUP) {
+		m2i_reload();
+	} else if (sig == SIGUSR1) {
+		log_dump();
 	} else {
 		g_message("Caught signal %u, exiting.", sig);
 		g_main_loop_quit(loop);
@@ -115,6 +146,24 @@ static gboolean m2i_signal_parse(GIOChannel *source,
 	return TRUE;
 }
 
+/* applies a changed config file without restarting */
+static void m2i_reload(void)
+{
+	struct preferences old;
+
+	if (!prefs_reload(&old)) {
+		g_warning("Keeping the current configuration");
+		return;
+	}
+
+	log_reload(prefs.log_file, prefs.log_dump);
+	irc_reload(&old);
+	mpd_reload(&old);
+	prefs_free(&old);
+
+	g_message("Configuration reloaded");
+}
+
 static void m2i_fork(void)
 {
 	pid_t pid = fork();
@@ -124,4 +173,8 @@ static void m2i_fork(void)
 	} else if (pid > 0) { /* The parent */
 		exit(EXIT_SUCCESS);
 	}
+
+	/* detach from the controlling terminal */
+	if (setsid() < 0)
+		g_critical("Failed to create a new session.");
 }
@@ -6,145 +6,514 @@
  */
 
 
+#include <string.h>
+
+#include <gio/gio.h>
 #include <glib.h>
 #include <mpd/client.h>
 
+#include "capture.h"
 #include "irc.h"
 #include "mpd.h"
+#include "notify.h"
 #include "preferences.h"
+#include "probes.h"
+#include "reconnect.h"
+#include "request.h"
+#include "stats.h"
+#include "timer.h"
+#include "vote.h"
+
+#define REQUEST_BATCH		16
+#define REQUEST_DELAY		500	/* ms */
+#define VOTE_FLUSH_INTERVAL	60	/* s */
+#define STATS_DELAY		2	/* s */
+
+/* what the idle connection waits for */
+#define MPD_IDLE_EVENTS		(MPD_IDLE_PLAYER | MPD_IDLE_QUEUE | \
+		MPD_IDLE_DATABASE)
+
+/* a connection being set up, or used for statistics, in a worker thread */
+struct mpd_sync {
+	gchar *server;
+	gchar *password;
+	gint port;
+
+	struct mpd_connection *conn;
+	struct mpd_status *status;
+	struct mpd_song *song;
+	struct stats *stats;
+	gchar *error;
+};
 
+static void mpd_connect_thread(GTask *task, gpointer source,
+		gpointer task_data, GCancellable *cancellable);
+static void mpd_connected(GObject *source, GAsyncResult *result,
+		gpointer user_data);
+static struct mpd_sync *mpd_sync_new(void);
+static void mpd_sync_free(gpointer data);
 static gboolean mpd_parse(GIOChannel *channel, GIOCondition condition,
 		gboolean user_data);
 static void mpd_disconnect(void);
+static void mpd_connection_lost(void);
 static gboolean mpd_reconnect(G_GNUC_UNUSED gpointer data);
 static void mpd_update(void);
+static struct stats *mpd_stats_fetch(struct mpd_connection *conn);
+static void mpd_stats_schedule(void);
+static gboolean mpd_stats_refresh(G_GNUC_UNUSED gpointer data);
+static void mpd_stats_thread(GTask *task, gpointer source,
+		gpointer task_data, GCancellable *cancellable);
+static void mpd_stats_done(GObject *source, GAsyncResult *result,
+		gpointer user_data);
+static void mpd_keep_song(struct mpd_song *song);
 static void mpd_report_error(void);
+static gboolean mpd_finish(struct mpd_connection *conn,
+		const gchar *command);
+static void mpd_request_schedule(void);
+static gboolean mpd_request_flush(G_GNUC_UNUSED gpointer data);
+static void mpd_request_drop(const gchar *uri, const gchar *reason);
+static void mpd_request_sync(gint *after);
+static const gchar *mpd_vote_song(void);
+static void mpd_vote_schedule(void);
+static gboolean mpd_vote_flush(G_GNUC_UNUSED gpointer data);
+static gboolean mpd_vote_read(GPtrArray *counts, guint64 *likes,
+		guint64 *skips);
+static guint mpd_vote_write(GPtrArray *counts, const guint64 *likes,
+		const guint64 *skips);
+static gboolean mpd_vote_drop(GPtrArray *counts, guint i);
 
 static struct {
 	struct mpd_connection *conn;
 	struct mpd_status *status;
 	struct mpd_song *song;
 	guint idle_source;
-	guint reconnect_source;
-} mpd;
+	struct reconnect reconnect;
+	gboolean connecting;
+	gboolean restart;
+	guint request_source;
+	guint vote_source;
+	guint stats_source;
+	gboolean stats_running;
+	gboolean stats_stale;
+} mpd = {
+	.reconnect = { .name = "MPD", .attempt = mpd_reconnect },
+};
 
-gboolean mpd_connect(void)
+/*
+ * Connecting blocks until MPD answers, so it happens in a worker thread
+ * and mpd_connected() picks up the result in the main loop.
+ */
+void mpd_connect(void)
 {
-	mpd.conn = mpd_connection_new(prefs.mpd_server, prefs.mpd_port, 10000);
-	mpd.idle_source = 0;
+	struct mpd_sync *sync;
+	GTask *task;
 
-	if (mpd_connection_get_error(mpd.conn) != MPD_ERROR_SUCCESS) {
-		g_warning("Failed to connect to MPD: %s",
-				mpd_connection_get_error_message(mpd.conn));
-		return FALSE;
-	} else if (mpd_connection_cmp_server_version(mpd.conn, 0, 14, 0) < 0) {
-		g_critical("MPD too old, please upgrade to 0.14 or newer");
-		return FALSE;
+	/* settings changed while connecting, start over when it's done */
+	if (mpd.connecting) {
+		mpd.restart = TRUE;
+		return;
+	}
+	mpd.connecting = TRUE;
+
+	sync = mpd_sync_new();
+	task = g_task_new(NULL, NULL, mpd_connected, NULL);
+	g_task_set_task_data(task, sync, mpd_sync_free);
+	g_task_run_in_thread(task, mpd_connect_thread);
+	g_object_unref(task);
+}
+
+static void mpd_connect_thread(GTask *task, G_GNUC_UNUSED gpointer source,
+		gpointer task_data, G_GNUC_UNUSED GCancellable *cancellable)
+{
+	struct mpd_sync *sync = task_data;
+
+	sync->conn = mpd_connection_new(sync->server, sync->port, 10000);
+
+	if (mpd_connection_get_error(sync->conn) != MPD_ERROR_SUCCESS) {
+		sync->error = g_strdup_printf("Failed to connect to MPD: %s",
+				mpd_connection_get_error_message(sync->conn));
+	} else if (mpd_connection_cmp_server_version(sync->conn, 0, 14, 0) <
+			0) {
+		sync->error = g_strdup(
+				"MPD too old, please upgrade to 0.14 or newer");
 	} else {
-		GIOChannel *channel;
+		/* resync all state in a single round trip */
+		M2I_PROBE1(mpd_send, "sync");
+		mpd_command_list_begin(sync->conn, TRUE);
+		if (sync->password)
+			mpd_send_password(sync->conn, sync->password);
+		mpd_send_status(sync->conn);
+		mpd_send_current_song(sync->conn);
+		mpd_command_list_end(sync->conn);
 
-		mpd_command_list_begin(mpd.conn, TRUE);
-		if (prefs.mpd_password)
-			mpd_send_password(mpd.conn, prefs.mpd_password);
-		mpd_send_status(mpd.conn);
-		mpd_send_current_song(mpd.conn);
-		mpd_command_list_end(mpd.conn);
+		sync->status = mpd_recv_status(sync->conn);
+		if (sync->status && mpd_response_next(sync->conn))
+			sync->song = mpd_recv_song(sync->conn);
+		/* finish first so the response probe fires on every path */
+		if (!mpd_finish(sync->conn, "sync") || !sync->status)
+			sync->error = g_strdup_printf(
+					"Failed to sync with MPD: %s",
+					mpd_connection_get_error_message(
+						sync->conn));
+	}
 
-		mpd.status = mpd_recv_status(mpd.conn);
-		if (!mpd_response_next(mpd.conn)) {
-			mpd_report_error();
-			return FALSE;
-		}
-		mpd.song = mpd_recv_song(mpd.conn);
-		if (!mpd_response_finish(mpd.conn)) {
-			mpd_report_error();
-			return FALSE;
-		}
+	g_task_return_boolean(task, sync->error == NULL);
+}
+
+static void mpd_connected(G_GNUC_UNUSED GObject *source,
+		GAsyncResult *result, G_GNUC_UNUSED gpointer user_data)
+{
+	struct mpd_sync *sync = g_task_get_task_data(G_TASK(result));
+	GIOChannel *channel;
+	gboolean changed;
+
+	mpd.connecting = FALSE;
+	if (mpd.restart) {
+		mpd.restart = FALSE;
+		mpd_connect();
+		return;
+	}
+
+	if (!g_task_propagate_boolean(G_TASK(result), NULL)) {
+		g_warning("%s", sync->error);
+		reconnect_failed(&mpd.reconnect);
+		return;
+	}
 
-		g_message("Connected to MPD");
-		irc_say("Connected to MPD");
+	/* take ownership of the connection and the synced state */
+	mpd.conn = sync->conn;
+	sync->conn = NULL;
 
-		mpd_send_idle_mask(mpd.conn, MPD_IDLE_PLAYER);
+	g_message("Connected to MPD");
+	if (reconnect_done(&mpd.reconnect))
+		irc_say("Reconnected to MPD");
 
-		channel = g_io_channel_unix_new(
-				mpd_connection_get_fd(mpd.conn));
-		mpd.idle_source = g_io_add_watch(channel, G_IO_IN,
-				(GIOFunc) mpd_parse, NULL);
-		g_io_channel_unref(channel);
+	/* only announce songs that started while we were away */
+	changed = sync->song && (!mpd.song ||
+			strcmp(mpd_song_get_uri(sync->song),
+				mpd_song_get_uri(mpd.song)) != 0);
+	if (mpd_set_status(sync->status) && changed)
+		mpd_set_song(sync->song);
+	else
+		mpd_store_song(sync->song);
+	sync->status = NULL;
+	sync->song = NULL;
 
-		return TRUE;
+	/* counted separately so they don't hold up the connection */
+	mpd_stats_schedule();
+
+	/* the queue may have changed, or MPD restarted, while we were away */
+	if (request_outstanding()) {
+		mpd_request_sync(NULL);
+		if (!mpd.conn)
+			return;
 	}
+
+	mpd_send_idle_mask(mpd.conn, MPD_IDLE_EVENTS);
+
+	channel = g_io_channel_unix_new(mpd_connection_get_fd(mpd.conn));
+	mpd.idle_source = g_io_add_watch(channel, G_IO_IN,
+			(GIOFunc) mpd_parse, NULL);
+	g_io_channel_unref(channel);
+
+	notify_up(NOTIFY_MPD);
+
+	/* requests and votes made during the outage */
+	mpd_request_schedule();
+	mpd_vote_schedule();
+}
+
+static struct mpd_sync *mpd_sync_new(void)
+{
+	struct mpd_sync *sync = g_new0(struct mpd_sync, 1);
+
+	sync->server = g_strdup(prefs.mpd_server);
+	sync->password = g_strdup(prefs.mpd_password);
+	sync->port = prefs.mpd_port;
+	return sync;
+}
+
+static void mpd_sync_free(gpointer data)
+{
+	struct mpd_sync *sync = data;
+
+	if (sync->conn)
+		mpd_connection_free(sync->conn);
+	if (sync->status)
+		mpd_status_free(sync->status);
+	if (sync->song)
+		mpd_song_free(sync->song);
+	if (sync->stats)
+		stats_free(sync->stats);
+	g_free(sync->server);
+	g_free(sync->password);
+	g_free(sync->error);
+	g_free(sync);
 }
 
 static gboolean mpd_parse(G_GNUC_UNUSED GIOChannel *channel,
 		G_GNUC_UNUSED GIOCondition condition,
 		G_GNUC_UNUSED gboolean user_data)
 {
-	mpd_recv_idle(mpd.conn, FALSE);
+	enum mpd_idle idle = mpd_recv_idle(mpd.conn, FALSE);
 
-	if (!mpd_response_finish(mpd.conn)) {
+	M2I_PROBE1(mpd_idle, idle);
+	if (!mpd_finish(mpd.conn, "idle")) {
 		mpd_report_error();
-		return FALSE;
+		if (!mpd.conn)
+			return FALSE;
+	} else {
+		if (idle & MPD_IDLE_DATABASE)
+			mpd_stats_schedule();
+		if ((idle & MPD_IDLE_QUEUE) && request_outstanding())
+			mpd_request_sync(NULL);
+		if (mpd.conn && (idle & MPD_IDLE_PLAYER))
+			mpd_update();
+		if (!mpd.conn)
+			return FALSE;
 	}
 
-	mpd_update();
-
-	mpd_send_idle_mask(mpd.conn, MPD_IDLE_PLAYER);
+	mpd_send_idle_mask(mpd.conn, MPD_IDLE_EVENTS);
 	return TRUE;
 }
 
 static void mpd_disconnect(void)
 {
+	if (mpd.idle_source > 0)
+		g_source_remove(mpd.idle_source);
+	mpd.idle_source = 0;
+
 	if (mpd.conn)
 		mpd_connection_free(mpd.conn);
 	mpd.conn = NULL;
-	irc_say("Disconnected from MPD");
 }
 
-void mpd_schedule_reconnect(void)
+/* announces an outage once, no matter how many attempts it takes */
+static void mpd_connection_lost(void)
 {
-	mpd.reconnect_source = g_timeout_add_seconds(30, mpd_reconnect, NULL);
+	mpd_disconnect();
+	notify_down(NOTIFY_MPD);
+	if (reconnect_lost(&mpd.reconnect))
+		irc_say("Disconnected from MPD");
 }
 
 static gboolean mpd_reconnect(G_GNUC_UNUSED gpointer data)
 {
-	if (!mpd_connect()) {
-		mpd_disconnect();
-		return TRUE; // try again
-	}
-
-	mpd.reconnect_source = 0;
-	return FALSE; // remove event
+	mpd_connect();
+	return FALSE;
 }
 
 static void mpd_update(void)
 {
-	enum mpd_state prev = MPD_STATE_UNKNOWN;
-
-	if (mpd.status) {
-		prev = mpd_status_get_state(mpd.status);
-		mpd_status_free(mpd.status);
-	}
+	struct mpd_status *status;
+	struct mpd_song *song;
 
-	mpd.status = mpd_run_status(mpd.conn);
-	if (!mpd_response_finish(mpd.conn)) {
+	M2I_PROBE1(mpd_send, "status");
+	status = mpd_run_status(mpd.conn);
+	if (!mpd_finish(mpd.conn, "status")) {
 		mpd_report_error();
 		return;
 	}
 
-	if (mpd_status_get_state(mpd.status) == MPD_STATE_PLAY &&
-			prev != MPD_STATE_PAUSE) {
-		if (mpd.song)
-			mpd_song_free(mpd.song);
-		mpd.song = mpd_run_current_song(mpd.conn);
-		if (!mpd_response_finish(mpd.conn)) {
+	if (mpd_set_status(status)) {
+		M2I_PROBE1(mpd_send, "currentsong");
+		song = mpd_run_current_song(mpd.conn);
+		if (!mpd_finish(mpd.conn, "currentsong")) {
 			mpd_report_error();
 			return;
 		}
+		mpd_set_song(song);
+	}
+}
+
+/*
+ * Fetches the library totals and MPD's own per artist, genre and date
+ * song counts in one round trip.  Servers that cannot group counts
+ * (MPD < 0.21) leave the connection usable and yield NULL.
+ */
+static struct stats *mpd_stats_fetch(struct mpd_connection *conn)
+{
+	static const enum mpd_tag_type tags[STATS_GROUPS] = {
+		[STATS_ARTIST] = MPD_TAG_ARTIST,
+		[STATS_GENRE] = MPD_TAG_GENRE,
+		[STATS_DECADE] = MPD_TAG_DATE,
+	};
+	struct stats *s = stats_new();
+	struct mpd_stats *totals;
+	struct mpd_pair *pair;
+	gchar *value = NULL;
 
-		if (prefs.announce)
-			mpd_announce_song();
+	M2I_PROBE1(mpd_send, "count");
+	mpd_command_list_begin(conn, TRUE);
+	mpd_send_stats(conn);
+	for (guint i = 0; i < STATS_GROUPS; i++) {
+		mpd_count_db_songs(conn);
+		mpd_search_add_group_tag(conn, tags[i]);
+		mpd_search_commit(conn);
 	}
+	mpd_command_list_end(conn);
+
+	totals = mpd_recv_stats(conn);
+	if (totals) {
+		stats_set_totals(s, mpd_stats_get_number_of_songs(totals),
+				mpd_stats_get_number_of_artists(totals),
+				mpd_stats_get_number_of_albums(totals),
+				mpd_stats_get_db_play_time(totals));
+		mpd_stats_free(totals);
+	}
+
+	/* every group value is followed by its songs and playtime */
+	for (guint i = 0; i < STATS_GROUPS && mpd_response_next(conn); i++) {
+		while ((pair = mpd_recv_pair(conn)) != NULL) {
+			if (strcmp(pair->name, "songs") == 0)
+				stats_add(s, i, value, g_ascii_strtoull(
+							pair->value, NULL,
+							10));
+			else if (strcmp(pair->name, "playtime") != 0) {
+				g_free(value);
+				value = g_strdup(pair->value);
+			}
+			mpd_return_pair(conn, pair);
+		}
+		g_free(value);
+		value = NULL;
+	}
+
+	if (!mpd_finish(conn, "count")) {
+		stats_free(s);
+		if (mpd_connection_get_error(conn) == MPD_ERROR_SERVER)
+			mpd_connection_clear_error(conn);
+		return NULL;
+	}
+	return s;
+}
+
+/* an update changes the database in bursts, refresh once it settles */
+static void mpd_stats_schedule(void)
+{
+	if (mpd.stats_source > 0)
+		timer_remove(mpd.stats_source);
+	mpd.stats_source = timer_add_seconds(STATS_DELAY, mpd_stats_refresh,
+			NULL);
+}
+
+/*
+ * Counting takes a while on big databases, so like connecting it happens
+ * in a worker thread, on a connection of its own.
+ */
+static gboolean mpd_stats_refresh(G_GNUC_UNUSED gpointer data)
+{
+	GTask *task;
+
+	mpd.stats_source = 0;
+	if (mpd.stats_running) {
+		mpd.stats_stale = TRUE;
+		return FALSE;
+	}
+	mpd.stats_running = TRUE;
+	mpd.stats_stale = FALSE;
+
+	task = g_task_new(NULL, NULL, mpd_stats_done, NULL);
+	g_task_set_task_data(task, mpd_sync_new(), mpd_sync_free);
+	g_task_run_in_thread(task, mpd_stats_thread);
+	g_object_unref(task);
+	return FALSE;
+}
+
+static void mpd_stats_thread(GTask *task, G_GNUC_UNUSED gpointer source,
+		gpointer task_data, G_GNUC_UNUSED GCancellable *cancellable)
+{
+	struct mpd_sync *sync = task_data;
+
+	sync->conn = mpd_connection_new(sync->server, sync->port, 10000);
+
+	if (mpd_connection_get_error(sync->conn) == MPD_ERROR_SUCCESS &&
+			sync->password) {
+		M2I_PROBE1(mpd_send, "password");
+		mpd_send_password(sync->conn, sync->password);
+		mpd_finish(sync->conn, "password");
+	}
+	if (mpd_connection_get_error(sync->conn) == MPD_ERROR_SUCCESS)
+		sync->stats = mpd_stats_fetch(sync->conn);
+	if (mpd_connection_get_error(sync->conn) != MPD_ERROR_SUCCESS)
+		sync->error = g_strdup_printf(
+				"Failed to refresh library statistics: %s",
+				mpd_connection_get_error_message(sync->conn));
+
+	g_task_return_boolean(task, sync->error == NULL);
+}
+
+static void mpd_stats_done(G_GNUC_UNUSED GObject *source,
+		GAsyncResult *result, G_GNUC_UNUSED gpointer user_data)
+{
+	struct mpd_sync *sync = g_task_get_task_data(G_TASK(result));
+
+	mpd.stats_running = FALSE;
+	if (!g_task_propagate_boolean(G_TASK(result), NULL))
+		g_warning("%s", sync->error);
+	else if (sync->stats)
+		stats_install(sync->stats);
+	sync->stats = NULL;
+
+	/* the database changed again in the meantime */
+	if (mpd.stats_stale)
+		mpd_stats_schedule();
+}
+
+void mpd_say_stats(void)
+{
+	const gchar * const *lines = stats_lines();
+
+	if (!lines) {
+		irc_say("No library statistics available");
+		return;
+	}
+
+	for (guint i = 0; lines[i]; i++)
+		irc_say("%s", lines[i]);
+}
+
+/* Replaces the cached status, returns TRUE if a new song started playing */
+gboolean mpd_set_status(struct mpd_status *status)
+{
+	enum mpd_state prev = MPD_STATE_UNKNOWN;
+
+	capture_mpd_status(status);
+
+	if (mpd.status) {
+		prev = mpd_status_get_state(mpd.status);
+		mpd_status_free(mpd.status);
+	}
+	mpd.status = status;
+
+	return mpd_status_get_state(mpd.status) == MPD_STATE_PLAY &&
+		prev != MPD_STATE_PAUSE;
+}
+
+void mpd_set_song(struct mpd_song *song)
+{
+	capture_mpd_song(song, TRUE);
+	mpd_keep_song(song);
+
+	if (mpd.song && prefs.announce)
+		mpd_announce_song();
+}
+
+/* takes the current song without announcing it */
+void mpd_store_song(struct mpd_song *song)
+{
+	capture_mpd_song(song, FALSE);
+	mpd_keep_song(song);
+}
+
+static void mpd_keep_song(struct mpd_song *song)
+{
+	if (song)
+		request_played(mpd_song_get_id(song));
+
+	if (mpd.song)
+		mpd_song_free(mpd.song);
+	mpd.song = song;
 }
 
 void mpd_announce_song(void)
@@ -155,6 +524,7 @@ void mpd_announce_song(void)
 	song = mpd_song_get_tag(mpd.song, MPD_TAG_TITLE, 0);
 	album = mpd_song_get_tag(mpd.song, MPD_TAG_ALBUM, 0);
 
+	M2I_PROBE1(mpd_announce, mpd_song_get_uri(mpd.song));
 	irc_say("Now playing: %s - %s (%s)", artist, song, album);
 }
 
@@ -167,16 +537,18 @@ void mpd_next(void)
 	}
 
 	mpd_run_noidle(mpd.conn);
+	M2I_PROBE1(mpd_send, "next");
 	mpd_run_next(mpd.conn);
-	if (!mpd_response_finish(mpd.conn)) {
+	if (!mpd_finish(mpd.conn, "next")) {
 		mpd_report_error();
 		return;
 	}
-	mpd_send_idle_mask(mpd.conn, MPD_IDLE_PLAYER);
+	mpd_send_idle_mask(mpd.conn, MPD_IDLE_EVENTS);
 }
 
 void mpd_say_status(void)
 {
+	struct mpd_status *status;
 	gchar *state;
 	gchar *artist, *title;
 
@@ -185,16 +557,15 @@ void mpd_say_status(void)
 		return;
 	}
 
-	if (mpd.status)
-		mpd_status_free(mpd.status);
-
 	mpd_run_noidle(mpd.conn);
-	mpd.status = mpd_run_status(mpd.conn);
-	if (!mpd_response_finish(mpd.conn)) {
+	M2I_PROBE1(mpd_send, "status");
+	status = mpd_run_status(mpd.conn);
+	if (!mpd_finish(mpd.conn, "status")) {
 		mpd_report_error();
 		return;
 	}
-	mpd_send_idle_mask(mpd.conn, MPD_IDLE_PLAYER);
+	mpd_set_status(status);
+	mpd_send_idle_mask(mpd.conn, MPD_IDLE_EVENTS);
 
 	switch (mpd_status_get_state(mpd.status)) {
 		case MPD_STATE_STOP:
@@ -231,23 +602,67 @@ void mpd_say_status(void)
 	g_free(title);
 }
 
+/* only reconnects if the MPD settings changed */
+void mpd_reload(const struct preferences *old)
+{
+	if (g_strcmp0(old->mpd_server, prefs.mpd_server) == 0 &&
+			old->mpd_port == prefs.mpd_port &&
+			g_strcmp0(old->mpd_password, prefs.mpd_password) == 0)
+		return;
+
+	g_message("MPD settings changed, reconnecting");
+	mpd_disconnect();
+	notify_down(NOTIFY_MPD);
+	reconnect_cancel(&mpd.reconnect);
+	mpd_connect();
+}
+
 void mpd_cleanup(void)
 {
-	if (mpd.idle_source > 0)
-		g_source_remove(mpd.idle_source);
+	if (mpd.request_source > 0)
+		timer_remove(mpd.request_source);
+	mpd.request_source = 0;
+	request_cleanup();
+
+	/* write out what has been voted since the last flush */
+	if (mpd.vote_source > 0)
+		timer_remove(mpd.vote_source);
+	mpd.vote_source = 0;
+	if (mpd.conn && vote_pending())
+		mpd_vote_flush(NULL);
+	vote_cleanup();
+
+	if (mpd.stats_source > 0)
+		timer_remove(mpd.stats_source);
+	mpd.stats_source = 0;
+	stats_cleanup();
+
+	reconnect_cancel(&mpd.reconnect);
 	mpd_disconnect();
 }
 
 static void mpd_report_error(void)
 {
-	const gchar *error = mpd_connection_get_error_message(mpd.conn);
+	gchar *error = g_strdup(mpd_connection_get_error_message(mpd.conn));
+
 	g_warning("MPD error: %s", error);
-	irc_say("MPD error: %s", error);
 	if (mpd_connection_clear_error(mpd.conn)) {
+		irc_say("MPD error: %s", error);
+	} else {
 		g_warning("Unable to recover, reconnecting");
-		mpd_disconnect();
-		mpd_schedule_reconnect();
+		mpd_connection_lost();
 	}
+	g_free(error);
+}
+
+/* finishes a command, the probe pairs up with the mpd_send one */
+static gboolean mpd_finish(struct mpd_connection *conn,
+		const gchar *command)
+{
+	gboolean success = mpd_response_finish(conn);
+
+	M2I_PROBE2(mpd_response, command, success);
+	return success;
 }
 
 void mpd_play(void)
@@ -258,12 +673,13 @@ void mpd_play(void)
 	}
 
 	mpd_run_noidle(mpd.conn);
+	M2I_PROBE1(mpd_send, "play");
 	mpd_run_play(mpd.conn);
-	if (!mpd_response_finish(mpd.conn)) {
+	if (!mpd_finish(mpd.conn, "play")) {
 		mpd_report_error();
 		return;
 	}
-	mpd_send_idle_mask(mpd.conn, MPD_IDLE_PLAYER);
+	mpd_send_idle_mask(mpd.conn, MPD_IDLE_EVENTS);
 }
 
 void mpd_pause(void)
@@ -274,12 +690,13 @@ void mpd_pause(void)
 	}
 
 	mpd_run_noidle(mpd.conn);
+	M2I_PROBE1(mpd_send, "pause");
 	mpd_run_toggle_pause(mpd.conn);
-	if (!mpd_response_finish(mpd.conn)) {
+	if (!mpd_finish(mpd.conn, "pause")) {
 		mpd_report_error();
 		return;
 	}
-	mpd_send_idle_mask(mpd.conn, MPD_IDLE_PLAYER);
+	mpd_send_idle_mask(mpd.conn, MPD_IDLE_EVENTS);
 }
 
 void mpd_prev(void)
@@ -290,50 +707,55 @@ void mpd_prev(void)
 	}
 
 	mpd_run_noidle(mpd.conn);
+	M2I_PROBE1(mpd_send, "previous");
 	mpd_run_previous(mpd.conn);
-	if (!mpd_response_finish(mpd.conn)) {
+	if (!mpd_finish(mpd.conn, "previous")) {
 		mpd_report_error();
 		return;
 	}
-	mpd_send_idle_mask(mpd.conn, MPD_IDLE_PLAYER);
+	mpd_send_idle_mask(mpd.conn, MPD_IDLE_EVENTS);
 }
 
 void mpd_repeat(void)
 {
-	const gboolean mode = !mpd_status_get_repeat(mpd.status);
+	gboolean mode;
 
 	if (!mpd.conn) {
 		irc_say("Not connected to MPD");
 		return;
 	}
+	mode = !mpd_status_get_repeat(mpd.status);
 
 	mpd_run_noidle(mpd.conn);
+	M2I_PROBE1(mpd_send, "repeat");
 	mpd_run_repeat(mpd.conn, mode);
-	if (!mpd_response_finish(mpd.conn)) {
+	if (!mpd_finish(mpd.conn, "repeat")) {
 		mpd_report_error();
 		return;
 	}
 	irc_say("Repeat %sabled", (mode ? "en" : "dis"));
-	mpd_send_idle_mask(mpd.conn, MPD_IDLE_PLAYER);
+	mpd_send_idle_mask(mpd.conn, MPD_IDLE_EVENTS);
 }
 
 void mpd_random(void)
 {
-	const gboolean mode = !mpd_status_get_random(mpd.status);
+	gboolean mode;
 
 	if (!mpd.conn) {
 		irc_say("Not connected to MPD");
 		return;
 	}
+	mode = !mpd_status_get_random(mpd.status);
 
 	mpd_run_noidle(mpd.conn);
+	M2I_PROBE1(mpd_send, "random");
 	mpd_run_random(mpd.conn, mode);
-	if (!mpd_response_finish(mpd.conn)) {
+	if (!mpd_finish(mpd.conn, "random")) {
 		mpd_report_error();
 		return;
 	}
 	irc_say("Random %sabled", (mode ? "en" : "dis"));
-	mpd_send_idle_mask(mpd.conn, MPD_IDLE_PLAYER);
+	mpd_send_idle_mask(mpd.conn, MPD_IDLE_EVENTS);
 }
 
 void mpd_stop(void)
@@ -344,10 +766,475 @@ void mpd_stop(void)
 	}
 
 	mpd_run_noidle(mpd.conn);
+	M2I_PROBE1(mpd_send, "stop");
 	mpd_run_stop(mpd.conn);
-	if (!mpd_response_finish(mpd.conn)) {
+	if (!mpd_finish(mpd.conn, "stop")) {
+		mpd_report_error();
+		return;
+	}
+	mpd_send_idle_mask(mpd.conn, MPD_IDLE_EVENTS);
+}
+
+void mpd_request(const gchar *nick, const gchar *query)
+{
+	struct mpd_song *song;
+	const gchar *artist, *title;
+	guint wait = 0;
+
+	if (!mpd.conn) {
+		irc_say("Not connected to MPD");
+		return;
+	}
+
+	mpd_run_noidle(mpd.conn);
+	M2I_PROBE1(mpd_send, "search");
+	mpd_search_db_songs(mpd.conn, FALSE);
+	mpd_search_add_any_tag_constraint(mpd.conn, MPD_OPERATOR_DEFAULT,
+			query);
+	mpd_search_add_window(mpd.conn, 0, 1);
+	mpd_search_commit(mpd.conn);
+	song = mpd_recv_song(mpd.conn);
+	if (!mpd_finish(mpd.conn, "search")) {
+		if (song)
+			mpd_song_free(song);
 		mpd_report_error();
+		if (mpd.conn)
+			mpd_send_idle_mask(mpd.conn, MPD_IDLE_EVENTS);
 		return;
 	}
-	mpd_send_idle_mask(mpd.conn, MPD_IDLE_PLAYER);
+	mpd_send_idle_mask(mpd.conn, MPD_IDLE_EVENTS);
+
+	if (!song) {
+		irc_say("%s: nothing found for \"%s\"", nick, query);
+		return;
+	}
+
+	artist = mpd_song_get_tag(song, MPD_TAG_ARTIST, 0);
+	title = mpd_song_get_tag(song, MPD_TAG_TITLE, 0);
+	switch (request_push(nick, mpd_song_get_uri(song),
+				mpd_song_get_duration(song), &wait)) {
+		case REQUEST_QUEUED:
+			if (artist && title)
+				irc_say("%s: requested %s - %s", nick, artist,
+						title);
+			else
+				irc_say("%s: requested %s", nick,
+						mpd_song_get_uri(song));
+			mpd_request_schedule();
+			break;
+		case REQUEST_DUPLICATE:
+			irc_say("%s: that song has already been requested",
+					nick);
+			break;
+		case REQUEST_COOLDOWN:
+			irc_say("%s: please wait %u seconds before your next "
+					"request", nick, wait);
+			break;
+	}
+	mpd_song_free(song);
+}
+
+/* requests are collected for a moment and then queued together */
+static void mpd_request_schedule(void)
+{
+	if (mpd.request_source == 0 && request_pending())
+		mpd.request_source = timer_add(REQUEST_DELAY,
+				mpd_request_flush, NULL);
+}
+
+static gboolean mpd_request_flush(G_GNUC_UNUSED gpointer data)
+{
+	GPtrArray *uris;
+	gint *ids, *positions;
+	guint *prios;
+	guint count, start = 0, done, failed;
+	gint after = -1;
+	gchar *error;
+
+	mpd.request_source = 0;
+	if (!mpd.conn)
+		return FALSE;
+
+	uris = g_ptr_array_new();
+	count = request_schedule(uris, REQUEST_BATCH);
+	ids = g_new(gint, count);
+	positions = g_new(gint, count);
+	prios = g_new0(guint, count);
+	for (guint i = 0; i < count; i++)
+		ids[i] = -1;
+
+	mpd_run_noidle(mpd.conn);
+
+	/* where each song goes depends on what is queued and playing now */
+	mpd_request_sync(&after);
+
+	/* add the whole batch in one round trip... */
+	while (mpd.conn && start < count) {
+		request_place(uris, start, after, positions);
+
+		M2I_PROBE1(mpd_send, "addid");
+		mpd_command_list_begin(mpd.conn, TRUE);
+		for (guint i = start; i < count; i++) {
+			if (positions[i] >= 0)
+				mpd_send_add_id_to(mpd.conn,
+						g_ptr_array_index(uris, i),
+						positions[i]);
+			else
+				mpd_send_add_id(mpd.conn,
+						g_ptr_array_index(uris, i));
+		}
+		mpd_command_list_end(mpd.conn);
+
+		for (done = start; done < count; done++) {
+			ids[done] = mpd_recv_song_id(mpd.conn);
+			if (ids[done] < 0)
+				break;
+			prios[done] = request_queued(g_ptr_array_index(uris,
+						done), ids[done], positions[done]);
+			if (!mpd_response_next(mpd.conn)) {
+				done++;
+				break;
+			}
+		}
+
+		if (mpd_finish(mpd.conn, "addid")) {
+			start = count;
+			break;
+		}
+
+		/*
+		 * A song that has left the database since the search fails
+		 * and aborts the rest of the list, drop only that one.
+		 */
+		failed = start +
+			mpd_connection_get_server_error_location(mpd.conn);
+		if (mpd_connection_get_error(mpd.conn) != MPD_ERROR_SERVER ||
+				failed != done) {
+			start = done;
+			break;
+		}
+		mpd_request_drop(g_ptr_array_index(uris, failed),
+				mpd_connection_get_error_message(mpd.conn));
+		start = failed + 1;
+		if (!mpd_connection_clear_error(mpd.conn))
+			break;
+	}
+
+	/* the connection broke, what is left was not queued */
+	if (start < count) {
+		error = g_strdup(mpd.conn ?
+				mpd_connection_get_error_message(mpd.conn) :
+				"not connected to MPD");
+		for (guint i = start; i < count; i++)
+			mpd_request_drop(g_ptr_array_index(uris, i), error);
+		g_free(error);
+		if (mpd.conn)
+			mpd_report_error();
+	}
+
+	/* ...and prioritise it the same way for random mode */
+	if (mpd.conn) {
+		M2I_PROBE1(mpd_send, "prioid");
+		mpd_command_list_begin(mpd.conn, FALSE);
+		for (guint i = 0; i < count; i++)
+			if (ids[i] >= 0)
+				mpd_send_prio_id(mpd.conn, prios[i], ids[i]);
+		mpd_command_list_end(mpd.conn);
+		if (!mpd_finish(mpd.conn, "prioid"))
+			mpd_report_error();
+	}
+
+	if (mpd.conn)
+		mpd_send_idle_mask(mpd.conn, MPD_IDLE_EVENTS);
+
+	g_free(prios);
+	g_free(positions);
+	g_free(ids);
+	g_ptr_array_free(uris, TRUE);
+
+	/* more than one batch was waiting */
+	mpd_request_schedule();
+	return FALSE;
+}
+
+/* tells the requester, the rest of the batch is queued all the same */
+static void mpd_request_drop(const gchar *uri, const gchar *reason)
+{
+	irc_say("%s: could not queue %s: %s", request_get_nick(uri), uri,
+			reason);
+	request_dropped(uri);
+}
+
+/*
+ * Updates where the queued requests are and forgets those that were
+ * played in consume mode or deleted.  after, if given, is set to the
+ * position behind the current song, or -1 if that is unknown.
+ */
+static void mpd_request_sync(gint *after)
+{
+	GHashTable *present;
+	unsigned pos, id;
+	gint current = -1, behind = 0;
+
+	if (mpd.status)
+		current = mpd_status_get_song_id(mpd.status);
+	present = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+	M2I_PROBE1(mpd_send, "plchangesposid");
+	mpd_send_queue_changes_brief(mpd.conn, 0);
+	while (mpd_recv_queue_change_brief(mpd.conn, &pos, &id)) {
+		g_hash_table_insert(present, GINT_TO_POINTER((gint) id),
+				GINT_TO_POINTER((gint) pos + 1));
+		if ((gint) id == current)
+			behind = pos + 1;
+	}
+
+	if (mpd_finish(mpd.conn, "plchangesposid")) {
+		request_sync(present);
+	} else {
+		behind = -1;
+		mpd_report_error();
+	}
+	if (after)
+		*after = behind;
+
+	g_hash_table_destroy(present);
+}
+
+void mpd_like(const gchar *nick)
+{
+	const gchar *uri = mpd_vote_song();
+	guint count;
+
+	if (!uri)
+		return;
+
+	if (vote_like(uri, nick, &count) == VOTE_DUPLICATE) {
+		irc_say("%s: you already like this song", nick);
+		return;
+	}
+	irc_say("%s likes this song (%u)", nick, count);
+	mpd_vote_schedule();
+}
+
+void mpd_skipvote(const gchar *nick)
+{
+	const gchar *uri = mpd_vote_song();
+	guint count;
+
+	if (!uri)
+		return;
+
+	switch (vote_skip(uri, nick, &count)) {
+		case VOTE_DUPLICATE:
+			irc_say("%s: you already voted to skip this song",
+					nick);
+			return;
+		case VOTE_COUNTED:
+			irc_say("Skip votes: %u/%d", count,
+					prefs.skip_threshold);
+			break;
+		case VOTE_PASSED:
+			irc_say("Skip vote passed");
+			mpd_next();
+			break;
+	}
+	mpd_vote_schedule();
+}
+
+/* returns the URI of the song being voted on, or NULL if there is none */
+static const gchar *mpd_vote_song(void)
+{
+	const gchar *uri;
+
+	if (!mpd.conn) {
+		irc_say("Not connected to MPD");
+		return NULL;
+	}
+	if (!mpd.song) {
+		irc_say("No song is playing");
+		return NULL;
+	}
+
+	/* streams have no place in the sticker database */
+	uri = mpd_song_get_uri(mpd.song);
+	if (strstr(uri, "://")) {
+		irc_say("Votes are only counted for songs in the database");
+		return NULL;
+	}
+	return uri;
+}
+
+static void mpd_vote_schedule(void)
+{
+	if (mpd.vote_source == 0 && vote_pending())
+		mpd.vote_source = timer_add_seconds(VOTE_FLUSH_INTERVAL,
+				mpd_vote_flush, NULL);
+}
+
+/*
+ * Adds the counted votes to the stickers: one command list reads the
+ * stored totals of every voted song, a second one writes the new ones.
+ */
+static gboolean mpd_vote_flush(G_GNUC_UNUSED gpointer data)
+{
+	GPtrArray *counts;
+	guint64 *likes, *skips;
+	guint written = 0;
+
+	mpd.vote_source = 0;
+	if (!mpd.conn)
+		return FALSE;
+
+	counts = vote_take();
+	likes = g_new0(guint64, counts->len);
+	skips = g_new0(guint64, counts->len);
+
+	mpd_run_noidle(mpd.conn);
+
+	if (mpd_vote_read(counts, likes, skips))
+		written = mpd_vote_write(counts, likes, skips);
+
+	g_free(likes);
+	g_free(skips);
+
+	if (written < counts->len) {
+		/* try the rest again with the next flush */
+		g_ptr_array_remove_range(counts, 0, written);
+		vote_restore(counts);
+		mpd_report_error();
+	} else {
+		g_ptr_array_free(counts, TRUE);
+	}
+	if (mpd.conn)
+		mpd_send_idle_mask(mpd.conn, MPD_IDLE_EVENTS);
+
+	mpd_vote_schedule();
+	return FALSE;
+}
+
+/*
+ * Reads the stickers of every counted song.  A song that has left the
+ * database fails its command and with it the rest of the list, so its
+ * votes are dropped and the list is resumed behind it.  Returns FALSE if
+ * anything else went wrong.
+ */
+static gboolean mpd_vote_read(GPtrArray *counts, guint64 *likes,
+		guint64 *skips)
+{
+	struct vote_count *c;
+	struct mpd_pair *pair;
+	guint start = 0;
+
+	while (start < counts->len) {
+		M2I_PROBE1(mpd_send, "sticker list");
+		mpd_command_list_begin(mpd.conn, TRUE);
+		for (guint i = start; i < counts->len; i++) {
+			c = g_ptr_array_index(counts, i);
+			mpd_send_sticker_list(mpd.conn, "song", c->uri);
+		}
+		mpd_command_list_end(mpd.conn);
+
+		for (guint i = start; i < counts->len; i++) {
+			while ((pair = mpd_recv_sticker(mpd.conn)) != NULL) {
+				if (strcmp(pair->name, VOTE_STICKER_LIKES) == 0)
+					likes[i] = g_ascii_strtoull(
+							pair->value, NULL, 10);
+				else if (strcmp(pair->name,
+							VOTE_STICKER_SKIPS) == 0)
+					skips[i] = g_ascii_strtoull(
+							pair->value, NULL, 10);
+				mpd_return_sticker(mpd.conn, pair);
+			}
+			if (!mpd_response_next(mpd.conn))
+				break;
+		}
+
+		if (mpd_finish(mpd.conn, "sticker list"))
+			return TRUE;
+
+		start += mpd_connection_get_server_error_location(mpd.conn);
+		if (!mpd_vote_drop(counts, start))
+			return FALSE;
+		start++;
+	}
+
+	return TRUE;
+}
+
+/*
+ * Adds the counts to the stickers read before, resuming behind a song
+ * that fails like mpd_vote_read() does.  Returns how many leading entries
+ * are written or dropped, all of them unless the connection broke.
+ */
+static guint mpd_vote_write(GPtrArray *counts, const guint64 *likes,
+		const guint64 *skips)
+{
+	struct vote_count *c;
+	GArray *sent;
+	gchar *value;
+	guint start = 0, failed;
+
+	/* which entry each command of the list belongs to */
+	sent = g_array_new(FALSE, FALSE, sizeof(guint));
+
+	while (start < counts->len) {
+		g_array_set_size(sent, 0);
+
+		M2I_PROBE1(mpd_send, "sticker set");
+		mpd_command_list_begin(mpd.conn, FALSE);
+		for (guint i = start; i < counts->len; i++) {
+			c = g_ptr_array_index(counts, i);
+			if (c->likes > 0) {
+				value = g_strdup_printf("%" G_GUINT64_FORMAT,
+						likes[i] + c->likes);
+				mpd_send_sticker_set(mpd.conn, "song", c->uri,
+						VOTE_STICKER_LIKES, value);
+				g_array_append_val(sent, i);
+				g_free(value);
+			}
+			if (c->skips > 0) {
+				value = g_strdup_printf("%" G_GUINT64_FORMAT,
+						skips[i] + c->skips);
+				mpd_send_sticker_set(mpd.conn, "song", c->uri,
+						VOTE_STICKER_SKIPS, value);
+				g_array_append_val(sent, i);
+				g_free(value);
+			}
+		}
+		mpd_command_list_end(mpd.conn);
+
+		if (mpd_finish(mpd.conn, "sticker set"))
+			break;
+
+		failed = mpd_connection_get_server_error_location(mpd.conn);
+		if (failed >= sent->len)
+			break;
+		failed = g_array_index(sent, guint, failed);
+		if (!mpd_vote_drop(counts, failed))
+			break;
+		start = failed + 1;
+	}
+
+	g_array_free(sent, TRUE);
+	return mpd_connection_get_error(mpd.conn) == MPD_ERROR_SUCCESS ?
+		counts->len : start;
+}
+
+/* gives up on the votes of a song MPD refused, FALSE if that wasn't it */
+static gboolean mpd_vote_drop(GPtrArray *counts, guint i)
+{
+	struct vote_count *c;
+
+	if (mpd_connection_get_error(mpd.conn) != MPD_ERROR_SERVER ||
+			i >= counts->len)
+		return FALSE;
+
+	c = g_ptr_array_index(counts, i);
+	g_warning("Dropping votes for %s: %s", c->uri,
+			mpd_connection_get_error_message(mpd.conn));
+	c->likes = 0;
+	c->skips = 0;
+
+	return mpd_connection_clear_error(mpd.conn);
 }
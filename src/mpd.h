@@ -9,11 +9,18 @@
 #ifndef HAVE_MPD_H
 #define HAVE_MPD_H
 
-gboolean mpd_connect(void);
-void mpd_schedule_reconnect(void);
+struct mpd_status;
+struct mpd_song;
+struct preferences;
+
+void mpd_connect(void);
+gboolean mpd_set_status(struct mpd_status *status);
+void mpd_set_song(struct mpd_song *song);
+void mpd_store_song(struct mpd_song *song);
 void mpd_announce_song(void);
 void mpd_next(void);
 void mpd_say_status(void);
+void mpd_reload(const struct preferences *old);
 void mpd_cleanup(void);
 void mpd_play(void);
 void mpd_pause(void);
@@ -21,5 +28,9 @@ void mpd_prev(void);
 void mpd_repeat(void);
 void mpd_random(void);
 void mpd_stop(void);
+void mpd_request(const gchar *nick, const gchar *query);
+void mpd_like(const gchar *nick);
+void mpd_skipvote(const gchar *nick);
+void mpd_say_stats(void);
 
 #endif /* HAVE_MPD_H */
@@ -0,0 +1,142 @@
+/*
+ * mpd2irc - MPD->IRC gateway
+ *
+ * Copyright 2008-2011 Christoph Mende
+ * All rights reserved. Released under the 2-clause BSD license.
+ */
+
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <glib.h>
+
+#include "notify.h"
+#include "timer.h"
+
+/*
+ * Service manager notifications (the sd_notify protocol): datagrams sent
+ * to the socket named by $NOTIFY_SOCKET.  READY=1 is sent once IRC has
+ * joined the channel and MPD is synced, and if $WATCHDOG_USEC is set a
+ * keepalive is sent from the main loop at half that interval, so a
+ * stalled loop gets the daemon restarted.  Any datagram socket can stand
+ * in for the service manager.
+ */
+
+#define NOTIFY_ALL (NOTIFY_IRC | NOTIFY_MPD)
+
+static void notify_send(const gchar *state);
+static void notify_status(void);
+static gboolean notify_watchdog(gpointer data);
+
+static gint notify_fd = -1;
+static struct sockaddr_un notify_addr;
+static socklen_t notify_addr_len;
+static guint services = 0;
+static gboolean ready = FALSE;
+static guint watchdog_source = 0;
+
+/* returns TRUE if a service manager is listening */
+gboolean notify_init(void)
+{
+	const gchar *path = g_getenv("NOTIFY_SOCKET");
+	const gchar *watchdog = g_getenv("WATCHDOG_USEC");
+	const gchar *watchdog_pid = g_getenv("WATCHDOG_PID");
+	gint64 usec;
+	gsize len;
+
+	if (!path || (path[0] != '/' && path[0] != '@'))
+		return FALSE;
+
+	len = strlen(path);
+	if (len >= sizeof(notify_addr.sun_path)) {
+		g_warning("NOTIFY_SOCKET path too long: %s", path);
+		return FALSE;
+	}
+
+	memset(&notify_addr, 0, sizeof(notify_addr));
+	notify_addr.sun_family = AF_UNIX;
+	memcpy(notify_addr.sun_path, path, len);
+	/* '@' denotes the abstract namespace */
+	if (path[0] == '@')
+		notify_addr.sun_path[0] = '\0';
+	notify_addr_len = offsetof(struct sockaddr_un, sun_path) + len;
+
+	notify_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (notify_fd < 0) {
+		g_warning("Failed to create notification socket");
+		return FALSE;
+	}
+
+	if (watchdog && (!watchdog_pid ||
+				g_ascii_strtoll(watchdog_pid, NULL, 10) ==
+				getpid())) {
+		usec = g_ascii_strtoll(watchdog, NULL, 10);
+		if (usec > 0)
+			watchdog_source = timer_add(MAX(usec / 2000, 1),
+					notify_watchdog, NULL);
+	}
+
+	notify_status();
+	return TRUE;
+}
+
+void notify_up(enum notify_service service)
+{
+	services |= service;
+
+	if (!ready && services == NOTIFY_ALL) {
+		ready = TRUE;
+		notify_send("READY=1");
+	}
+	notify_status();
+}
+
+void notify_down(enum notify_service service)
+{
+	services &= ~service;
+	notify_status();
+}
+
+void notify_cleanup(void)
+{
+	if (watchdog_source > 0)
+		timer_remove(watchdog_source);
+	watchdog_source = 0;
+
+	notify_send("STOPPING=1");
+	if (notify_fd >= 0)
+		close(notify_fd);
+	notify_fd = -1;
+}
+
+static void notify_send(const gchar *state)
+{
+	if (notify_fd < 0)
+		return;
+
+	if (sendto(notify_fd, state, strlen(state), MSG_NOSIGNAL,
+				(struct sockaddr *) &notify_addr,
+				notify_addr_len) < 0)
+		g_warning("Failed to notify service manager");
+}
+
+static void notify_status(void)
+{
+	gchar *status = g_strdup_printf("STATUS=IRC %s, MPD %s",
+			(services & NOTIFY_IRC) ? "joined" : "connecting",
+			(services & NOTIFY_MPD) ? "synced" : "connecting");
+
+	notify_send(status);
+	g_free(status);
+}
+
+static gboolean notify_watchdog(G_GNUC_UNUSED gpointer data)
+{
+	notify_send("WATCHDOG=1");
+	return TRUE;
+}
@@ -0,0 +1,22 @@
+/*
+ * mpd2irc - MPD->IRC gateway
+ *
+ * Copyright 2008-2011 Christoph Mende
+ * All rights reserved. Released under the 2-clause BSD license.
+ */
+
+
+#ifndef HAVE_NOTIFY_H
+#define HAVE_NOTIFY_H
+
+enum notify_service {
+	NOTIFY_IRC = 1 << 0,
+	NOTIFY_MPD = 1 << 1
+};
+
+gboolean notify_init(void);
+void notify_up(enum notify_service service);
+void notify_down(enum notify_service service);
+void notify_cleanup(void);
+
+#endif /* HAVE_NOTIFY_H */
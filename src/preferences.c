@@ -8,79 +8,185 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <glib.h>
 
 #include "preferences.h"
 #include "config.h"
 
+static gboolean prefs_read(const gchar *path, struct preferences *p);
+static gchar *prefs_read_fingerprint(GKeyFile *config);
 static void print_version(void);
 
+struct preferences prefs;
+
 void parse_config(void)
+{
+	prefs_read(prefs.config_file, &prefs);
+	prefs.announce = TRUE;
+}
+
+/*
+ * Re-reads the config file, on success the previous settings are moved
+ * to old so the caller can apply the differences and free them.
+ */
+gboolean prefs_reload(struct preferences *old)
+{
+	struct preferences p = prefs;
+
+	if (!prefs_read(prefs.config_file, &p))
+		return FALSE;
+
+	*old = prefs;
+	prefs = p;
+	return TRUE;
+}
+
+/* reads the settings stored in the config file into p */
+static gboolean prefs_read(const gchar *path, struct preferences *p)
 {
 	GError *error = NULL;
 	GKeyFile *config = g_key_file_new();
 
-	if (!g_key_file_load_from_file(config, "mpd2irc.conf", 0, &error)) {
+	if (!g_key_file_load_from_file(config, path, 0, &error)) {
 		g_warning("Failed to parse configuration file: %s",
 				error->message);
 		g_error_free(error);
-		return;
+		g_key_file_free(config);
+		return FALSE;
 	}
 
 	/* MPD */
-	prefs.mpd_server = g_key_file_get_string(config, "mpd", "server", NULL);
-	if (!prefs.mpd_server)
-		prefs.mpd_server = g_strdup("localhost");
+	p->mpd_server = g_key_file_get_string(config, "mpd", "server", NULL);
+	if (!p->mpd_server)
+		p->mpd_server = g_strdup("localhost");
 
-	prefs.mpd_password = g_key_file_get_string(config, "mpd", "password",
+	p->mpd_password = g_key_file_get_string(config, "mpd", "password",
 			NULL);
-	prefs.mpd_port = g_key_file_get_integer(config, "mpd", "port", NULL);
-	if (!prefs.mpd_port)
-		prefs.mpd_port = 6600;
+	p->mpd_port = g_key_file_get_integer(config, "mpd", "port", NULL);
+	if (!p->mpd_port)
+		p->mpd_port = 6600;
 
 	/* IRC */
-	prefs.irc_server = g_key_file_get_string(config, "irc", "server", NULL);
-	prefs.irc_use_ssl = g_key_file_get_boolean(config, "irc", "use_ssl",
+	p->irc_server = g_key_file_get_string(config, "irc", "server", NULL);
+	p->irc_use_ssl = g_key_file_get_boolean(config, "irc", "use_ssl",
 			NULL);
-	prefs.irc_password = g_key_file_get_string(config, "irc", "password",
+	p->irc_password = g_key_file_get_string(config, "irc", "password",
 			NULL);
-	prefs.irc_channel = g_key_file_get_string(config, "irc", "channel",
+	p->irc_channel = g_key_file_get_string(config, "irc", "channel",
 			NULL);
-	prefs.irc_nick = g_key_file_get_string(config, "irc", "nick", NULL);
-	if (!prefs.irc_nick)
-		prefs.irc_nick = g_strdup(PACKAGE_NAME);
+	p->irc_nick = g_key_file_get_string(config, "irc", "nick", NULL);
+	if (!p->irc_nick)
+		p->irc_nick = g_strdup(PACKAGE_NAME);
 
-	prefs.irc_realname = g_key_file_get_string(config, "irc", "realname",
+	p->irc_realname = g_key_file_get_string(config, "irc", "realname",
 			NULL);
-	if (!prefs.irc_realname)
-		prefs.irc_realname = g_strdup(PACKAGE_STRING);
+	if (!p->irc_realname)
+		p->irc_realname = g_strdup(PACKAGE_STRING);
 
-	prefs.irc_username = g_key_file_get_string(config, "irc", "username",
+	p->irc_username = g_key_file_get_string(config, "irc", "username",
 			NULL);
-	if (!prefs.irc_username)
-		prefs.irc_username = g_strdup(PACKAGE_NAME);
+	if (!p->irc_username)
+		p->irc_username = g_strdup(PACKAGE_NAME);
+
+	p->irc_tls_certificate = g_key_file_get_string(config, "irc",
+			"tls_certificate", NULL);
+	p->irc_tls_verify = TRUE;
+	if (g_key_file_has_key(config, "irc", "tls_verify", NULL))
+		p->irc_tls_verify = g_key_file_get_boolean(config, "irc",
+				"tls_verify", NULL);
+	p->irc_tls_fingerprint = prefs_read_fingerprint(config);
 
 	/* IRC auth */
-	prefs.irc_auth_serv = g_key_file_get_string(config, "irc", "authserv",
-			NULL);
-	prefs.irc_auth_string = g_key_file_get_string(config, "irc", "string",
-			NULL);
+	p->irc_auth_serv = g_key_file_get_string(config, "irc-auth",
+			"authserv", NULL);
+	if (p->irc_auth_serv && !*p->irc_auth_serv) {
+		g_free(p->irc_auth_serv);
+		p->irc_auth_serv = NULL;
+	}
+	p->irc_auth_string = g_key_file_get_string(config, "irc-auth",
+			"string", NULL);
+
+	p->irc_sasl_mechanism = g_key_file_get_string(config, "irc-auth",
+			"sasl_mechanism", NULL);
+	if (p->irc_sasl_mechanism) {
+		gchar *mech = g_ascii_strup(p->irc_sasl_mechanism, -1);
+		g_free(p->irc_sasl_mechanism);
+		p->irc_sasl_mechanism = NULL;
+
+		if (strcmp(mech, "PLAIN") == 0 ||
+				strcmp(mech, "EXTERNAL") == 0) {
+			p->irc_sasl_mechanism = mech;
+		} else {
+			if (*mech)
+				g_warning("Unsupported SASL mechanism: %s",
+						mech);
+			g_free(mech);
+		}
+	}
+	p->irc_sasl_username = g_key_file_get_string(config, "irc-auth",
+			"sasl_username", NULL);
+	p->irc_sasl_password = g_key_file_get_string(config, "irc-auth",
+			"sasl_password", NULL);
 
 	/* general */
-	prefs.die_password = g_key_file_get_string(config, "general",
+	p->die_password = g_key_file_get_string(config, "general",
 			"die_password", NULL);
+	if (g_key_file_has_key(config, "general", "request_cooldown", NULL))
+		p->request_cooldown = g_key_file_get_integer(config,
+				"general", "request_cooldown", NULL);
+	else
+		p->request_cooldown = 30;
+	p->skip_threshold = g_key_file_get_integer(config, "general",
+			"skip_threshold", NULL);
+	if (p->skip_threshold <= 0)
+		p->skip_threshold = 3;
+	p->log_file = g_key_file_get_string(config, "general", "log_file",
+			NULL);
+	p->log_dump = g_key_file_get_string(config, "general", "log_dump",
+			NULL);
 
 	g_key_file_free(config);
 
-	prefs.announce = TRUE;
+	return TRUE;
+}
+
+/* SHA-256 fingerprints are accepted with or without colons */
+static gchar *prefs_read_fingerprint(GKeyFile *config)
+{
+	gchar *value, *fingerprint;
+	GString *hex;
+
+	value = g_key_file_get_string(config, "irc", "tls_fingerprint", NULL);
+	if (!value)
+		return NULL;
+
+	hex = g_string_new(NULL);
+	for (const gchar *c = value; *c; c++)
+		if (g_ascii_isxdigit(*c))
+			g_string_append_c(hex, g_ascii_tolower(*c));
+	g_free(value);
+
+	if (hex->len == 0) {
+		g_string_free(hex, TRUE);
+		return NULL;
+	} else if (hex->len != 64) {
+		g_warning("Ignoring tls_fingerprint, not a SHA-256 "
+				"fingerprint");
+		g_string_free(hex, TRUE);
+		return NULL;
+	}
+
+	fingerprint = g_string_free(hex, FALSE);
+	return fingerprint;
 }
 
 void parse_args(gint argc, gchar *argv[])
 {
 	GError *error = NULL;
-	gchar *config;
-	gboolean version = FALSE, foreground = FALSE;
+	gchar *config = NULL, *capture = NULL, *replay = NULL;
+	gboolean version = FALSE, foreground = FALSE, realtime = FALSE;
 	GOptionContext *context;
 	GOptionEntry entries[] = {
 		{ "config", 'c', 0, G_OPTION_ARG_FILENAME, &config,
@@ -89,6 +195,12 @@ void parse_args(gint argc, gchar *argv[])
 			"print the program version", NULL },
 		{ "foreground", 'f', 0, G_OPTION_ARG_NONE, &foreground,
 			"don't fork to background", NULL },
+		{ "capture", 0, 0, G_OPTION_ARG_FILENAME, &capture,
+			"record IRC and MPD traffic to a file", "path" },
+		{ "replay", 0, 0, G_OPTION_ARG_FILENAME, &replay,
+			"replay a capture file without connecting", "path" },
+		{ "realtime", 0, 0, G_OPTION_ARG_NONE, &realtime,
+			"replay at the original speed", NULL },
 		{ NULL, 0, 0, 0, NULL, NULL, NULL }
 	};
 	context = g_option_context_new("- the interface between IRC and MPD");
@@ -103,7 +215,11 @@ void parse_args(gint argc, gchar *argv[])
 	if (version)
 		print_version();
 
+	prefs.config_file = config ? config : g_strdup("mpd2irc.conf");
 	prefs.foreground = foreground;
+	prefs.capture_file = capture;
+	prefs.replay_file = replay;
+	prefs.replay_realtime = realtime;
 }
 
 static void print_version(void)
@@ -115,17 +231,33 @@ static void print_version(void)
 	exit(EXIT_SUCCESS);
 }
 
+/* frees the settings read from the config file */
+void prefs_free(struct preferences *p)
+{
+	g_free(p->mpd_server);
+	g_free(p->mpd_password);
+	g_free(p->irc_server);
+	g_free(p->irc_password);
+	g_free(p->irc_channel);
+	g_free(p->irc_nick);
+	g_free(p->irc_realname);
+	g_free(p->irc_username);
+	g_free(p->irc_tls_certificate);
+	g_free(p->irc_tls_fingerprint);
+	g_free(p->irc_auth_serv);
+	g_free(p->irc_auth_string);
+	g_free(p->irc_sasl_mechanism);
+	g_free(p->irc_sasl_username);
+	g_free(p->irc_sasl_password);
+	g_free(p->die_password);
+	g_free(p->log_file);
+	g_free(p->log_dump);
+}
+
 void prefs_cleanup(void)
 {
-	g_free(prefs.mpd_server);
-	g_free(prefs.mpd_password);
-	g_free(prefs.irc_server);
-	g_free(prefs.irc_password);
-	g_free(prefs.irc_channel);
-	g_free(prefs.irc_nick);
-	g_free(prefs.irc_realname);
-	g_free(prefs.irc_username);
-	g_free(prefs.irc_auth_serv);
-	g_free(prefs.irc_auth_string);
-	g_free(prefs.die_password);
+	prefs_free(&prefs);
+	g_free(prefs.config_file);
+	g_free(prefs.capture_file);
+	g_free(prefs.replay_file);
 }
@@ -9,7 +9,7 @@
 #ifndef HAVE_PREFERENCES_H
 #define HAVE_PREFERENCES_H
 
-struct {
+struct preferences {
 	/* MPD */
 	gchar *mpd_server;
 	gchar *mpd_password;
@@ -23,21 +23,39 @@ struct {
 	gchar *irc_nick;
 	gchar *irc_realname;
 	gchar *irc_username;
+	gchar *irc_tls_certificate;
+	gboolean irc_tls_verify;
+	gchar *irc_tls_fingerprint;
 
 	/* IRC auth */
 	gchar *irc_auth_serv;
 	gchar *irc_auth_string;
+	gchar *irc_sasl_mechanism;
+	gchar *irc_sasl_username;
+	gchar *irc_sasl_password;
 
 	/* general */
 	gchar *die_password;
+	gint request_cooldown;
+	gint skip_threshold;
+	gchar *log_file;
+	gchar *log_dump;
 
 	/* other */
+	gchar *config_file;
 	gboolean announce;
 	gboolean foreground;
-} prefs;
+	gchar *capture_file;
+	gchar *replay_file;
+	gboolean replay_realtime;
+};
+
+extern struct preferences prefs;
 
 void parse_config(void);
 void parse_args(gint argc, gchar *argv[]);
+gboolean prefs_reload(struct preferences *old);
+void prefs_free(struct preferences *p);
 void prefs_cleanup(void);
 
 #endif /* HAVE_PREFERENCES_H */
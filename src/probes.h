@@ -0,0 +1,35 @@
+/*
+ * mpd2irc - MPD->IRC gateway
+ *
+ * Copyright 2008-2011 Christoph Mende
+ * All rights reserved. Released under the 2-clause BSD license.
+ */
+
+
+#ifndef HAVE_PROBES_H
+#define HAVE_PROBES_H
+
+#include "config.h"
+
+/*
+ * Static tracepoints (USDT) for bpftrace, perf or SystemTap, e.g.
+ *   bpftrace -e 'usdt:/usr/bin/mpd2irc:mpd2irc:irc_line { ... }'
+ * A probe is a single nop until a tracer attaches, without
+ * --enable-sdt they are not compiled in at all.
+ */
+
+#ifdef ENABLE_SDT
+#include <sys/sdt.h>
+
+#define M2I_PROBE0(name)		DTRACE_PROBE(mpd2irc, name)
+#define M2I_PROBE1(name, a)		DTRACE_PROBE1(mpd2irc, name, a)
+#define M2I_PROBE2(name, a, b)		DTRACE_PROBE2(mpd2irc, name, a, b)
+#define M2I_PROBE3(name, a, b, c)	DTRACE_PROBE3(mpd2irc, name, a, b, c)
+#else
+#define M2I_PROBE0(name)		do { } while (0)
+#define M2I_PROBE1(name, a)		do { } while (0)
+#define M2I_PROBE2(name, a, b)		do { } while (0)
+#define M2I_PROBE3(name, a, b, c)	do { } while (0)
+#endif
+
+#endif /* HAVE_PROBES_H */
@@ -0,0 +1,129 @@
+/*
+ * mpd2irc - MPD->IRC gateway
+ *
+ * Copyright 2008-2011 Christoph Mende
+ * All rights reserved. Released under the 2-clause BSD license.
+ */
+
+
+#include <glib.h>
+
+#include "probes.h"
+#include "reconnect.h"
+#include "timer.h"
+
+/*
+ * Retries start almost immediately and back off exponentially with jitter,
+ * so a restarted service is picked up within a second while a longer
+ * outage doesn't keep hammering it.  After RECONNECT_BREAKER failures in a
+ * row the circuit opens and only one attempt per RECONNECT_COOLDOWN is
+ * made until a connection succeeds again.  A connection only resets the
+ * failure count once it has stayed up for RECONNECT_STABLE, one that
+ * drops earlier counts as another failed attempt, so a server that keeps
+ * accepting and closing connections is backed off from like any other.
+ */
+
+static void reconnect_schedule(struct reconnect *r, guint delay);
+static gboolean reconnect_fire(gpointer data);
+static gboolean reconnect_stable(gpointer data);
+
+/*
+ * The connection dropped, try again right away if it had been stable.
+ * Returns TRUE if this starts a new outage that should be announced.
+ */
+gboolean reconnect_lost(struct reconnect *r)
+{
+	gboolean announce = !r->outage;
+
+	g_message("Lost connection to %s, reconnecting", r->name);
+	if (r->stable > 0) {
+		reconnect_failed(r);
+	} else {
+		r->outage = TRUE;
+		reconnect_schedule(r, g_random_int_range(0, RECONNECT_BASE));
+	}
+
+	return announce;
+}
+
+/* A connection attempt failed, back off before the next one */
+void reconnect_failed(struct reconnect *r)
+{
+	guint delay;
+
+	if (r->stable > 0)
+		timer_remove(r->stable);
+	r->stable = 0;
+
+	r->outage = TRUE;
+	r->failures++;
+
+	if (r->failures >= RECONNECT_BREAKER) {
+		if (r->failures == RECONNECT_BREAKER)
+			g_warning("%u attempts to reach %s failed, "
+					"retrying every %u s", r->failures,
+					r->name, RECONNECT_COOLDOWN / 1000);
+		delay = RECONNECT_COOLDOWN;
+	} else {
+		delay = MIN(RECONNECT_BASE << (r->failures - 1),
+				RECONNECT_MAX);
+	}
+
+	/* equal jitter: keep half the delay, randomize the rest */
+	reconnect_schedule(r, delay / 2 +
+			g_random_int_range(0, delay / 2 + 1));
+}
+
+/*
+ * The connection is up again, the failures are forgotten once it stays up.
+ * Returns TRUE if an outage ended that should be announced.
+ */
+gboolean reconnect_done(struct reconnect *r)
+{
+	gboolean announce = r->outage;
+
+	M2I_PROBE2(reconnect_done, r->name, r->failures);
+	reconnect_cancel(r);
+	r->outage = FALSE;
+	r->stable = timer_add_seconds(RECONNECT_STABLE, reconnect_stable, r);
+
+	return announce;
+}
+
+void reconnect_cancel(struct reconnect *r)
+{
+	if (r->source > 0)
+		timer_remove(r->source);
+	r->source = 0;
+	if (r->stable > 0)
+		timer_remove(r->stable);
+	r->stable = 0;
+}
+
+static void reconnect_schedule(struct reconnect *r, guint delay)
+{
+	M2I_PROBE3(reconnect_scheduled, r->name, r->failures, delay);
+	reconnect_cancel(r);
+	r->source = timer_add(delay, reconnect_fire, r);
+}
+
+static gboolean reconnect_fire(gpointer data)
+{
+	struct reconnect *r = data;
+
+	r->source = 0;
+	M2I_PROBE1(reconnect_attempt, r->name);
+	r->attempt(NULL);
+
+	return FALSE;
+}
+
+static gboolean reconnect_stable(gpointer data)
+{
+	struct reconnect *r = data;
+
+	r->stable = 0;
+	r->failures = 0;
+
+	return FALSE;
+}
@@ -0,0 +1,33 @@
+/*
+ * mpd2irc - MPD->IRC gateway
+ *
+ * Copyright 2008-2011 Christoph Mende
+ * All rights reserved. Released under the 2-clause BSD license.
+ */
+
+
+#ifndef HAVE_RECONNECT_H
+#define HAVE_RECONNECT_H
+
+#define RECONNECT_BASE		250	/* ms */
+#define RECONNECT_MAX		60000	/* ms */
+#define RECONNECT_BREAKER	10
+#define RECONNECT_COOLDOWN	300000	/* ms */
+#define RECONNECT_STABLE	30	/* s */
+
+struct reconnect {
+	const gchar *name;
+	GSourceFunc attempt;
+
+	guint source;
+	guint stable;
+	guint failures;
+	gboolean outage;
+};
+
+gboolean reconnect_lost(struct reconnect *r);
+void reconnect_failed(struct reconnect *r);
+gboolean reconnect_done(struct reconnect *r);
+void reconnect_cancel(struct reconnect *r);
+
+#endif /* HAVE_RECONNECT_H */
@@ -0,0 +1,397 @@
+/*
+ * mpd2irc - MPD->IRC gateway
+ *
+ * Copyright 2008-2011 Christoph Mende
+ * All rights reserved. Released under the 2-clause BSD license.
+ */
+
+
+#include <glib.h>
+
+#include "preferences.h"
+#include "request.h"
+#include "timer.h"
+
+/*
+ * Song requests are scheduled by deficit round robin over the requesting
+ * nicks: every turn a requester is credited REQUEST_QUANTUM seconds of
+ * play time and may dequeue songs as long as the credit covers them, so
+ * nobody can monopolise a batch with many (or long) requests.
+ *
+ * Once in MPD's queue a request is remembered by its song id and position
+ * until it starts playing or leaves the queue, and a song cannot be
+ * requested again while it is still waiting.  The queue behind the current
+ * song takes turns between requesters: a request is inserted behind every
+ * queued one that is as many or fewer songs into its requester's list and
+ * ahead of the rest, so a newcomer's first request goes ahead of everyone's
+ * second one, whichever batch it came in.  MPD only honours priorities in
+ * random mode, they are set to the same effect for that.
+ */
+
+#define REQUEST_QUANTUM 300 /* seconds */
+#define REQUEST_PRIO_MAX 255
+#define REQUEST_PRIO_STEP 16
+
+struct requester {
+	GQueue songs;
+	gint64 deficit;
+	gint64 last;
+	gboolean active;
+	/* songs queued in MPD and not played yet */
+	guint outstanding;
+};
+
+struct request {
+	gchar *uri;
+	gchar *nick;
+	guint duration;
+	struct requester *requester;
+	/* MPD song id and queue position once queued, -1 before */
+	gint id;
+	gint pos;
+};
+
+/* a queued request, or one about to be, while working out positions */
+struct request_slot {
+	struct requester *requester;
+	gint pos;
+	/* how many songs into its requester's list */
+	guint round;
+};
+
+static struct requester *request_get_requester(const gchar *nick);
+static void request_free(struct request *req);
+static void request_requester_free(gpointer data);
+static gboolean request_sync_one(gpointer key, gpointer value,
+		gpointer present);
+static gint request_slot_compare(gconstpointer a, gconstpointer b);
+
+/* casefolded nick -> struct requester */
+static GHashTable *requesters = NULL;
+/* uri -> struct request, from !request until it plays */
+static GHashTable *requested = NULL;
+/* MPD song id -> struct request */
+static GHashTable *queued = NULL;
+/* requesters with songs waiting, in round robin order */
+static GQueue active = G_QUEUE_INIT;
+
+enum request_result request_push(const gchar *nick, const gchar *uri,
+		guint duration, guint *wait)
+{
+	struct requester *r = request_get_requester(nick);
+	struct request *req;
+	const gint64 now = timer_now();
+	const gint64 cooldown = (gint64) prefs.request_cooldown *
+		G_USEC_PER_SEC;
+
+	if (g_hash_table_lookup(requested, uri))
+		return REQUEST_DUPLICATE;
+
+	if (r->last > 0 && now - r->last < cooldown) {
+		*wait = (cooldown - (now - r->last)) / G_USEC_PER_SEC + 1;
+		return REQUEST_COOLDOWN;
+	}
+	r->last = now;
+
+	req = g_new(struct request, 1);
+	req->uri = g_strdup(uri);
+	req->nick = g_strdup(nick);
+	req->duration = duration;
+	req->requester = r;
+	req->id = -1;
+	req->pos = -1;
+	g_queue_push_tail(&r->songs, req);
+	g_hash_table_insert(requested, req->uri, req);
+
+	if (!r->active) {
+		r->active = TRUE;
+		g_queue_push_tail(&active, r);
+	}
+
+	return REQUEST_QUEUED;
+}
+
+/*
+ * Adds up to max URIs, in fair order, to uris.  They stay owned by the
+ * request until request_queued() or request_dropped() is called for them.
+ */
+guint request_schedule(GPtrArray *uris, guint max)
+{
+	struct requester *r;
+	struct request *req;
+	guint count = 0;
+
+	while (count < max && (r = g_queue_pop_head(&active)) != NULL) {
+		r->deficit += REQUEST_QUANTUM;
+
+		while (count < max && (req = g_queue_peek_head(&r->songs)) &&
+				req->duration <= r->deficit) {
+			g_queue_pop_head(&r->songs);
+			r->deficit -= req->duration;
+
+			g_ptr_array_add(uris, req->uri);
+			count++;
+		}
+
+		if (g_queue_is_empty(&r->songs)) {
+			r->deficit = 0;
+			r->active = FALSE;
+		} else {
+			g_queue_push_tail(&active, r);
+		}
+	}
+
+	return count;
+}
+
+/*
+ * Works out the queue positions for uris[start..], which go in this order
+ * behind position after - 1, the current song.  Without a current song
+ * position (after < 0) they are appended.
+ */
+void request_place(GPtrArray *uris, guint start, gint after,
+		gint *positions)
+{
+	struct request_slot slot, *s;
+	struct request *req;
+	GHashTableIter iter;
+	GHashTable *rounds;
+	GArray *slots;
+	gpointer value;
+	gint target;
+
+	if (after < 0) {
+		for (guint i = start; i < uris->len; i++)
+			positions[i] = -1;
+		return;
+	}
+
+	slots = g_array_new(FALSE, FALSE, sizeof(struct request_slot));
+	rounds = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+	g_hash_table_iter_init(&iter, queued);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		req = value;
+		if (req->pos < after)
+			continue;
+		slot.requester = req->requester;
+		slot.pos = req->pos;
+		g_array_append_val(slots, slot);
+	}
+	g_array_sort(slots, request_slot_compare);
+
+	for (guint j = 0; j < slots->len; j++) {
+		s = &g_array_index(slots, struct request_slot, j);
+		s->round = GPOINTER_TO_UINT(g_hash_table_lookup(rounds,
+					s->requester)) + 1;
+		g_hash_table_insert(rounds, s->requester,
+				GUINT_TO_POINTER(s->round));
+	}
+
+	for (guint i = start; i < uris->len; i++) {
+		req = g_hash_table_lookup(requested,
+				g_ptr_array_index(uris, i));
+		slot.requester = req->requester;
+		slot.round = GPOINTER_TO_UINT(g_hash_table_lookup(rounds,
+					req->requester)) + 1;
+		g_hash_table_insert(rounds, req->requester,
+				GUINT_TO_POINTER(slot.round));
+
+		target = after;
+		for (guint j = 0; j < slots->len; j++) {
+			s = &g_array_index(slots, struct request_slot, j);
+			if (s->round <= slot.round)
+				target = MAX(target, s->pos + 1);
+		}
+		for (guint j = 0; j < slots->len; j++) {
+			s = &g_array_index(slots, struct request_slot, j);
+			if (s->pos >= target)
+				s->pos++;
+		}
+
+		slot.pos = target;
+		g_array_append_val(slots, slot);
+		positions[i] = target;
+	}
+
+	g_hash_table_destroy(rounds);
+	g_array_free(slots, TRUE);
+}
+
+/*
+ * The song was added to MPD's queue at pos (-1 if appended), returns its
+ * priority.
+ */
+guint request_queued(const gchar *uri, gint id, gint pos)
+{
+	struct request *req = g_hash_table_lookup(requested, uri);
+	struct request *other;
+	GHashTableIter iter;
+	gpointer value;
+	guint n;
+
+	g_return_val_if_fail(req != NULL, 0);
+
+	/* everything from there on moved down by one */
+	if (pos >= 0) {
+		g_hash_table_iter_init(&iter, queued);
+		while (g_hash_table_iter_next(&iter, NULL, &value)) {
+			other = value;
+			if (other->pos >= pos)
+				other->pos++;
+		}
+	}
+
+	req->id = id;
+	req->pos = pos;
+	g_hash_table_insert(queued, GINT_TO_POINTER(id), req);
+	n = ++req->requester->outstanding;
+
+	return MAX(REQUEST_PRIO_MAX - (gint) (n - 1) * REQUEST_PRIO_STEP, 1);
+}
+
+/* who asked for a song that is not queued yet */
+const gchar *request_get_nick(const gchar *uri)
+{
+	struct request *req = g_hash_table_lookup(requested, uri);
+
+	g_return_val_if_fail(req != NULL, NULL);
+
+	return req->nick;
+}
+
+/* the song could not be added */
+void request_dropped(const gchar *uri)
+{
+	struct request *req = g_hash_table_lookup(requested, uri);
+
+	g_return_if_fail(req != NULL);
+
+	g_hash_table_remove(requested, uri);
+	request_free(req);
+}
+
+/* the song with this id started playing */
+void request_played(gint id)
+{
+	struct request *req;
+
+	if (!queued)
+		return;
+
+	req = g_hash_table_lookup(queued, GINT_TO_POINTER(id));
+	if (!req)
+		return;
+
+	g_hash_table_remove(queued, GINT_TO_POINTER(id));
+	request_sync_one(NULL, req, NULL);
+}
+
+/*
+ * Updates the positions of the queued requests from present, song id ->
+ * position + 1, and forgets those no longer in it.
+ */
+void request_sync(GHashTable *present)
+{
+	if (queued)
+		g_hash_table_foreach_remove(queued, request_sync_one, present);
+}
+
+gboolean request_pending(void)
+{
+	return !g_queue_is_empty(&active);
+}
+
+gboolean request_outstanding(void)
+{
+	return queued && g_hash_table_size(queued) > 0;
+}
+
+void request_cleanup(void)
+{
+	GHashTableIter iter;
+	gpointer value;
+
+	g_queue_clear(&active);
+	if (queued)
+		g_hash_table_destroy(queued);
+	queued = NULL;
+	if (requested) {
+		g_hash_table_iter_init(&iter, requested);
+		while (g_hash_table_iter_next(&iter, NULL, &value)) {
+			g_hash_table_iter_steal(&iter);
+			request_free(value);
+		}
+		g_hash_table_destroy(requested);
+	}
+	requested = NULL;
+	if (requesters)
+		g_hash_table_destroy(requesters);
+	requesters = NULL;
+}
+
+static struct requester *request_get_requester(const gchar *nick)
+{
+	struct requester *r;
+	gchar *key;
+
+	if (!requesters) {
+		requesters = g_hash_table_new_full(g_str_hash, g_str_equal,
+				g_free, request_requester_free);
+		requested = g_hash_table_new(g_str_hash, g_str_equal);
+		queued = g_hash_table_new(g_direct_hash, g_direct_equal);
+	}
+
+	key = g_ascii_strdown(nick, -1);
+	r = g_hash_table_lookup(requesters, key);
+	if (r) {
+		g_free(key);
+		return r;
+	}
+
+	r = g_new0(struct requester, 1);
+	g_queue_init(&r->songs);
+	g_hash_table_insert(requesters, key, r);
+	return r;
+}
+
+static void request_free(struct request *req)
+{
+	g_free(req->uri);
+	g_free(req->nick);
+	g_free(req);
+}
+
+/* the requests themselves are owned by requested */
+static void request_requester_free(gpointer data)
+{
+	struct requester *r = data;
+
+	g_queue_clear(&r->songs);
+	g_free(r);
+}
+
+/* drops a queued request unless its id is in present */
+static gboolean request_sync_one(gpointer key, gpointer value,
+		gpointer present)
+{
+	struct request *req = value;
+	gpointer pos;
+
+	if (present && (pos = g_hash_table_lookup(present, key)) != NULL) {
+		req->pos = GPOINTER_TO_INT(pos) - 1;
+		return FALSE;
+	}
+
+	req->requester->outstanding--;
+	g_hash_table_remove(requested, req->uri);
+	request_free(req);
+	return TRUE;
+}
+
+static gint request_slot_compare(gconstpointer a, gconstpointer b)
+{
+	const struct request_slot *x = a, *y = b;
+
+	return x->pos - y->pos;
+}
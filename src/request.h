@@ -0,0 +1,32 @@
+/*
+ * mpd2irc - MPD->IRC gateway
+ *
+ * Copyright 2008-2011 Christoph Mende
+ * All rights reserved. Released under the 2-clause BSD license.
+ */
+
+
+#ifndef HAVE_REQUEST_H
+#define HAVE_REQUEST_H
+
+enum request_result {
+	REQUEST_QUEUED,
+	REQUEST_DUPLICATE,
+	REQUEST_COOLDOWN
+};
+
+enum request_result request_push(const gchar *nick, const gchar *uri,
+		guint duration, guint *wait);
+guint request_schedule(GPtrArray *uris, guint max);
+void request_place(GPtrArray *uris, guint start, gint after,
+		gint *positions);
+guint request_queued(const gchar *uri, gint id, gint pos);
+const gchar *request_get_nick(const gchar *uri);
+void request_dropped(const gchar *uri);
+void request_played(gint id);
+void request_sync(GHashTable *present);
+gboolean request_pending(void);
+gboolean request_outstanding(void);
+void request_cleanup(void);
+
+#endif /* HAVE_REQUEST_H */
@@ -0,0 +1,202 @@
+/*
+ * mpd2irc - MPD->IRC gateway
+ *
+ * Copyright 2008-2011 Christoph Mende
+ * All rights reserved. Released under the 2-clause BSD license.
+ */
+
+
+#include <stdlib.h>
+
+#include <glib.h>
+
+#include "stats.h"
+
+/*
+ * Library statistics for !stats.  MPD aggregates the song counts per
+ * artist, genre and date itself (count group ...), they are folded into
+ * one hash table per group here, and the summary is rendered once when a
+ * new set is installed, so answering !stats never touches MPD.
+ */
+
+#define STATS_TOP 5
+
+struct stats {
+	/* value (or decade) -> song count */
+	GHashTable *groups[STATS_GROUPS];
+	guint songs;
+	guint artists;
+	guint albums;
+	guint64 play_time;
+};
+
+struct stats_entry {
+	gpointer key;
+	guint songs;
+};
+
+static void stats_render_group(GString *line, GHashTable *group,
+		gboolean decades);
+static gint stats_compare_songs(gconstpointer a, gconstpointer b);
+static gint stats_compare_decades(gconstpointer a, gconstpointer b);
+
+static gchar **lines = NULL;
+
+struct stats *stats_new(void)
+{
+	struct stats *s = g_new0(struct stats, 1);
+
+	s->groups[STATS_ARTIST] = g_hash_table_new_full(g_str_hash,
+			g_str_equal, g_free, NULL);
+	s->groups[STATS_GENRE] = g_hash_table_new_full(g_str_hash,
+			g_str_equal, g_free, NULL);
+	s->groups[STATS_DECADE] = g_hash_table_new(g_direct_hash,
+			g_direct_equal);
+	return s;
+}
+
+void stats_add(struct stats *s, enum stats_group group, const gchar *value,
+		guint songs)
+{
+	GHashTable *table = s->groups[group];
+	gpointer key;
+	guint year;
+
+	if (!value || !*value)
+		return;
+
+	if (group == STATS_DECADE) {
+		/* dates are YYYY or YYYY-MM-DD */
+		if (!g_ascii_isdigit(value[0]))
+			return;
+		year = strtoul(value, NULL, 10);
+		if (year < 1000 || year > 9999)
+			return;
+		key = GUINT_TO_POINTER(year / 10 * 10);
+		songs += GPOINTER_TO_UINT(g_hash_table_lookup(table, key));
+		g_hash_table_insert(table, key, GUINT_TO_POINTER(songs));
+	} else {
+		g_hash_table_insert(table, g_strdup(value),
+				GUINT_TO_POINTER(songs));
+	}
+}
+
+void stats_set_totals(struct stats *s, guint songs, guint artists,
+		guint albums, guint64 play_time)
+{
+	s->songs = songs;
+	s->artists = artists;
+	s->albums = albums;
+	s->play_time = play_time;
+}
+
+void stats_free(struct stats *s)
+{
+	for (guint i = 0; i < STATS_GROUPS; i++)
+		g_hash_table_destroy(s->groups[i]);
+	g_free(s);
+}
+
+/* renders the summary of s, which is consumed */
+void stats_install(struct stats *s)
+{
+	GPtrArray *rendered = g_ptr_array_new();
+	GString *line;
+
+	g_ptr_array_add(rendered, g_strdup_printf("Library: %u songs, "
+				"%u artists, %u albums, %" G_GUINT64_FORMAT
+				"d %" G_GUINT64_FORMAT "h %" G_GUINT64_FORMAT
+				"m of music", s->songs, s->artists,
+				s->albums, s->play_time / 86400,
+				s->play_time / 3600 % 24,
+				s->play_time / 60 % 60));
+
+	line = g_string_new("Top artists:");
+	stats_render_group(line, s->groups[STATS_ARTIST], FALSE);
+	g_ptr_array_add(rendered, g_string_free(line, FALSE));
+
+	line = g_string_new("Top genres:");
+	stats_render_group(line, s->groups[STATS_GENRE], FALSE);
+	g_ptr_array_add(rendered, g_string_free(line, FALSE));
+
+	line = g_string_new("Decades:");
+	stats_render_group(line, s->groups[STATS_DECADE], TRUE);
+	g_ptr_array_add(rendered, g_string_free(line, FALSE));
+
+	g_ptr_array_add(rendered, NULL);
+	g_strfreev(lines);
+	lines = (gchar **) g_ptr_array_free(rendered, FALSE);
+
+	stats_free(s);
+}
+
+/* NULL until the first set of statistics has been installed */
+const gchar * const *stats_lines(void)
+{
+	return (const gchar * const *) lines;
+}
+
+void stats_cleanup(void)
+{
+	g_strfreev(lines);
+	lines = NULL;
+}
+
+static void stats_render_group(GString *line, GHashTable *group,
+		gboolean decades)
+{
+	GArray *entries;
+	GHashTableIter iter;
+	struct stats_entry entry, *e;
+	gpointer key, value;
+	guint limit;
+
+	entries = g_array_sized_new(FALSE, FALSE, sizeof(entry),
+			g_hash_table_size(group));
+	g_hash_table_iter_init(&iter, group);
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		entry.key = key;
+		entry.songs = GPOINTER_TO_UINT(value);
+		g_array_append_val(entries, entry);
+	}
+
+	if (decades) {
+		g_array_sort(entries, stats_compare_decades);
+		limit = entries->len;
+	} else {
+		g_array_sort(entries, stats_compare_songs);
+		limit = MIN(entries->len, STATS_TOP);
+	}
+
+	for (guint i = 0; i < limit; i++) {
+		e = &g_array_index(entries, struct stats_entry, i);
+		if (decades)
+			g_string_append_printf(line, "%s %us (%u)",
+					i > 0 ? "," : "",
+					GPOINTER_TO_UINT(e->key), e->songs);
+		else
+			g_string_append_printf(line, "%s %s (%u)",
+					i > 0 ? "," : "",
+					(const gchar *) e->key, e->songs);
+	}
+	if (limit == 0)
+		g_string_append(line, " none");
+
+	g_array_free(entries, TRUE);
+}
+
+/* most songs first */
+static gint stats_compare_songs(gconstpointer a, gconstpointer b)
+{
+	const struct stats_entry *x = a, *y = b;
+
+	return (x->songs < y->songs) - (x->songs > y->songs);
+}
+
+static gint stats_compare_decades(gconstpointer a, gconstpointer b)
+{
+	const struct stats_entry *x = a, *y = b;
+	guint dx = GPOINTER_TO_UINT(x->key), dy = GPOINTER_TO_UINT(y->key);
+
+	return (dx > dy) - (dx < dy);
+}
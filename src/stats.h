@@ -0,0 +1,31 @@
+/*
+ * mpd2irc - MPD->IRC gateway
+ *
+ * Copyright 2008-2011 Christoph Mende
+ * All rights reserved. Released under the 2-clause BSD license.
+ */
+
+
+#ifndef HAVE_STATS_H
+#define HAVE_STATS_H
+
+enum stats_group {
+	STATS_ARTIST,
+	STATS_GENRE,
+	STATS_DECADE,
+	STATS_GROUPS
+};
+
+struct stats;
+
+struct stats *stats_new(void);
+void stats_add(struct stats *s, enum stats_group group, const gchar *value,
+		guint songs);
+void stats_set_totals(struct stats *s, guint songs, guint artists,
+		guint albums, guint64 play_time);
+void stats_free(struct stats *s);
+void stats_install(struct stats *s);
+const gchar * const *stats_lines(void);
+void stats_cleanup(void);
+
+#endif /* HAVE_STATS_H */
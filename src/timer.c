@@ -0,0 +1,148 @@
+/*
+ * mpd2irc - MPD->IRC gateway
+ *
+ * Copyright 2008-2011 Christoph Mende
+ * All rights reserved. Released under the 2-clause BSD license.
+ */
+
+
+#include <glib.h>
+
+#include "timer.h"
+
+/*
+ * All timeouts of the daemon go through here.  Normally they are plain
+ * GLib timeout sources, in virtual mode they are kept in a list ordered by
+ * deadline and only fire when timer_advance() moves the clock past them,
+ * so hours of reconnects can be simulated deterministically in no time.
+ */
+
+struct timer {
+	guint id;
+	gint64 interval;
+	gint64 deadline;
+	GSourceFunc func;
+	gpointer data;
+	gboolean removed;
+};
+
+static guint timer_add_virtual(gint64 interval, GSourceFunc func,
+		gpointer data);
+static gint timer_compare(gconstpointer a, gconstpointer b);
+
+static gboolean virtual = FALSE;
+static gint64 virtual_now = 0;
+static guint virtual_id = 0;
+static GList *timers = NULL;
+static struct timer *running = NULL;
+
+void timer_set_virtual(gboolean enable)
+{
+	virtual = enable;
+}
+
+/* monotonic time in microseconds */
+gint64 timer_now(void)
+{
+	if (virtual)
+		return virtual_now;
+
+	return g_get_monotonic_time();
+}
+
+/* interval in milliseconds */
+guint timer_add(guint interval, GSourceFunc func, gpointer data)
+{
+	if (!virtual)
+		return g_timeout_add(interval, func, data);
+
+	return timer_add_virtual((gint64) interval * 1000, func, data);
+}
+
+guint timer_add_seconds(guint interval, GSourceFunc func, gpointer data)
+{
+	if (!virtual)
+		return g_timeout_add_seconds(interval, func, data);
+
+	return timer_add_virtual((gint64) interval * G_USEC_PER_SEC, func,
+			data);
+}
+
+static guint timer_add_virtual(gint64 interval, GSourceFunc func,
+		gpointer data)
+{
+	struct timer *t = g_new0(struct timer, 1);
+
+	t->id = ++virtual_id;
+	t->interval = interval;
+	t->deadline = virtual_now + t->interval;
+	t->func = func;
+	t->data = data;
+	timers = g_list_insert_sorted(timers, t, timer_compare);
+
+	return t->id;
+}
+
+void timer_remove(guint id)
+{
+	if (!virtual) {
+		g_source_remove(id);
+		return;
+	}
+
+	if (running && running->id == id) {
+		running->removed = TRUE;
+		return;
+	}
+
+	for (GList *l = timers; l; l = l->next) {
+		struct timer *t = l->data;
+		if (t->id == id) {
+			timers = g_list_delete_link(timers, l);
+			g_free(t);
+			return;
+		}
+	}
+}
+
+/* moves the virtual clock forward, running every timer that comes due */
+void timer_advance(gint64 usec)
+{
+	const gint64 target = virtual_now + usec;
+	struct timer *t;
+
+	g_return_if_fail(virtual);
+
+	while (timers && (t = timers->data)->deadline <= target) {
+		timers = g_list_delete_link(timers, timers);
+		virtual_now = t->deadline;
+
+		running = t;
+		if (t->func(t->data) && !t->removed) {
+			t->deadline += t->interval;
+			timers = g_list_insert_sorted(timers, t,
+					timer_compare);
+		} else {
+			g_free(t);
+		}
+		running = NULL;
+	}
+
+	virtual_now = target;
+}
+
+void timer_cleanup(void)
+{
+	g_list_free_full(timers, g_free);
+	timers = NULL;
+}
+
+static gint timer_compare(gconstpointer a, gconstpointer b)
+{
+	const struct timer *ta = a, *tb = b;
+
+	if (ta->deadline != tb->deadline)
+		return ta->deadline < tb->deadline ? -1 : 1;
+
+	return ta->id < tb->id ? -1 : 1;
+}
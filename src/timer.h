@@ -0,0 +1,20 @@
+/*
+ * mpd2irc - MPD->IRC gateway
+ *
+ * Copyright 2008-2011 Christoph Mende
+ * All rights reserved. Released under the 2-clause BSD license.
+ */
+
+
+#ifndef HAVE_TIMER_H
+#define HAVE_TIMER_H
+
+void timer_set_virtual(gboolean enable);
+gint64 timer_now(void);
+guint timer_add(guint interval, GSourceFunc func, gpointer data);
+guint timer_add_seconds(guint interval, GSourceFunc func, gpointer data);
+void timer_remove(guint id);
+void timer_advance(gint64 usec);
+void timer_cleanup(void);
+
+#endif /* HAVE_TIMER_H */
@@ -0,0 +1,170 @@
+/*
+ * mpd2irc - MPD->IRC gateway
+ *
+ * Copyright 2008-2011 Christoph Mende
+ * All rights reserved. Released under the 2-clause BSD license.
+ */
+
+
+#include <string.h>
+
+#include <glib.h>
+
+#include "preferences.h"
+#include "vote.h"
+
+/*
+ * Votes are only counted here; mpd.c periodically takes the accumulated
+ * counts and adds them to the song stickers in one batch, so a busy
+ * channel costs MPD a couple of writes per song and interval instead of
+ * one per vote.  Every nick can vote once per song and kind.
+ */
+
+static struct vote_count *vote_get_count(const gchar *uri);
+static enum vote_result vote_add_voter(GHashTable **voters,
+		const gchar *uri, const gchar *nick);
+static void vote_count_free(gpointer data);
+
+/* uri -> struct vote_count */
+static GHashTable *counts = NULL;
+/* the song the voters below voted on */
+static gchar *current = NULL;
+/* casefolded nicks */
+static GHashTable *likers = NULL;
+static GHashTable *skippers = NULL;
+
+enum vote_result vote_like(const gchar *uri, const gchar *nick,
+		guint *count)
+{
+	if (vote_add_voter(&likers, uri, nick) == VOTE_DUPLICATE)
+		return VOTE_DUPLICATE;
+
+	vote_get_count(uri)->likes++;
+	*count = g_hash_table_size(likers);
+	return VOTE_COUNTED;
+}
+
+enum vote_result vote_skip(const gchar *uri, const gchar *nick,
+		guint *count)
+{
+	if (vote_add_voter(&skippers, uri, nick) == VOTE_DUPLICATE)
+		return VOTE_DUPLICATE;
+
+	vote_get_count(uri)->skips++;
+	*count = g_hash_table_size(skippers);
+	if (*count < (guint) prefs.skip_threshold)
+		return VOTE_COUNTED;
+
+	/* a song played again gets a fresh vote */
+	g_hash_table_remove_all(likers);
+	g_hash_table_remove_all(skippers);
+	return VOTE_PASSED;
+}
+
+/* hands the unwritten counts to the caller */
+GPtrArray *vote_take(void)
+{
+	GPtrArray *taken = g_ptr_array_new_with_free_func(vote_count_free);
+	GHashTableIter iter;
+	gpointer value;
+
+	if (!counts)
+		return taken;
+
+	g_hash_table_iter_init(&iter, counts);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		g_ptr_array_add(taken, value);
+		g_hash_table_iter_steal(&iter);
+	}
+	return taken;
+}
+
+/* merges counts that could not be written back in */
+void vote_restore(GPtrArray *taken)
+{
+	struct vote_count *c, *old;
+
+	for (guint i = 0; i < taken->len; i++) {
+		c = g_ptr_array_index(taken, i);
+		if (c->likes == 0 && c->skips == 0)
+			continue;
+		old = vote_get_count(c->uri);
+		old->likes += c->likes;
+		old->skips += c->skips;
+	}
+	g_ptr_array_free(taken, TRUE);
+}
+
+gboolean vote_pending(void)
+{
+	return counts && g_hash_table_size(counts) > 0;
+}
+
+void vote_cleanup(void)
+{
+	if (counts)
+		g_hash_table_destroy(counts);
+	counts = NULL;
+	if (likers)
+		g_hash_table_destroy(likers);
+	likers = NULL;
+	if (skippers)
+		g_hash_table_destroy(skippers);
+	skippers = NULL;
+	g_free(current);
+	current = NULL;
+}
+
+static struct vote_count *vote_get_count(const gchar *uri)
+{
+	struct vote_count *c;
+
+	if (!counts)
+		counts = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+				vote_count_free);
+
+	c = g_hash_table_lookup(counts, uri);
+	if (!c) {
+		c = g_new0(struct vote_count, 1);
+		c->uri = g_strdup(uri);
+		g_hash_table_insert(counts, c->uri, c);
+	}
+	return c;
+}
+
+static enum vote_result vote_add_voter(GHashTable **voters,
+		const gchar *uri, const gchar *nick)
+{
+	gchar *key;
+
+	if (!likers) {
+		likers = g_hash_table_new_full(g_str_hash, g_str_equal,
+				g_free, NULL);
+		skippers = g_hash_table_new_full(g_str_hash, g_str_equal,
+				g_free, NULL);
+	}
+
+	/* the voters only ever refer to the current song */
+	if (g_strcmp0(current, uri) != 0) {
+		g_free(current);
+		current = g_strdup(uri);
+		g_hash_table_remove_all(likers);
+		g_hash_table_remove_all(skippers);
+	}
+
+	key = g_ascii_strdown(nick, -1);
+	if (g_hash_table_contains(*voters, key)) {
+		g_free(key);
+		return VOTE_DUPLICATE;
+	}
+	g_hash_table_add(*voters, key);
+	return VOTE_COUNTED;
+}
+
+static void vote_count_free(gpointer data)
+{
+	struct vote_count *c = data;
+
+	g_free(c->uri);
+	g_free(c);
+}
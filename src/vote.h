@@ -0,0 +1,37 @@
+/*
+ * mpd2irc - MPD->IRC gateway
+ *
+ * Copyright 2008-2011 Christoph Mende
+ * All rights reserved. Released under the 2-clause BSD license.
+ */
+
+
+#ifndef HAVE_VOTE_H
+#define HAVE_VOTE_H
+
+#define VOTE_STICKER_LIKES "mpd2irc-likes"
+#define VOTE_STICKER_SKIPS "mpd2irc-skipvotes"
+
+enum vote_result {
+	VOTE_COUNTED,
+	VOTE_DUPLICATE,
+	VOTE_PASSED
+};
+
+/* votes not yet written to the sticker database */
+struct vote_count {
+	gchar *uri;
+	guint likes;
+	guint skips;
+};
+
+enum vote_result vote_like(const gchar *uri, const gchar *nick,
+		guint *count);
+enum vote_result vote_skip(const gchar *uri, const gchar *nick,
+		guint *count);
+GPtrArray *vote_take(void);
+void vote_restore(GPtrArray *counts);
+gboolean vote_pending(void);
+void vote_cleanup(void);
+
+#endif /* HAVE_VOTE_H */
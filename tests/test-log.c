@@ -0,0 +1,161 @@
+/*
+ * mpd2irc - MPD->IRC gateway
+ *
+ * Copyright 2008-2011 Christoph Mende
+ * All rights reserved. Released under the 2-clause BSD license.
+ */
+
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "log.h"
+
+/*
+ * Logs through the ring into a file and counts what comes out: every
+ * message is either written or accounted for as lost, only the rate
+ * limit may drop messages silently, and only at the site that exceeds it.
+ */
+
+#define TEST_SITES	200
+
+static gchar *test_dir = NULL;
+static gchar *test_file = NULL;
+static gchar *test_contents = NULL;
+
+static gint64 test_window(void);
+static void test_start(void);
+static void test_stop(void);
+static void test_count(const gchar *marker, guint *written, guint *lost);
+static void test_finish(void);
+
+static gint64 test_window(void)
+{
+	return g_get_monotonic_time() / (LOG_WINDOW * G_USEC_PER_SEC);
+}
+
+static void test_start(void)
+{
+	test_dir = g_dir_make_tmp("mpd2irc-XXXXXX", NULL);
+	g_assert_nonnull(test_dir);
+	test_file = g_build_filename(test_dir, "log", NULL);
+
+	log_init(test_file, NULL);
+}
+
+/* stops the flusher, which writes out the rest, and reads the file */
+static void test_stop(void)
+{
+	log_cleanup();
+	g_assert_true(g_file_get_contents(test_file, &test_contents, NULL,
+				NULL));
+}
+
+/* lost messages can't be told apart, they all count for marker */
+static void test_count(const gchar *marker, guint *written, guint *lost)
+{
+	gchar **lines;
+	guint n;
+
+	*written = 0;
+	*lost = 0;
+	lines = g_strsplit(test_contents, "\n", 0);
+	for (guint i = 0; lines[i]; i++) {
+		if (strstr(lines[i], " log messages lost") &&
+				sscanf(lines[i], "%u", &n) == 1)
+			*lost += n;
+		else if (strstr(lines[i], marker))
+			(*written)++;
+	}
+	g_strfreev(lines);
+}
+
+static void test_finish(void)
+{
+	g_free(test_contents);
+	test_contents = NULL;
+	unlink(test_file);
+	g_rmdir(test_dir);
+	g_free(test_file);
+	g_free(test_dir);
+	test_file = NULL;
+	test_dir = NULL;
+}
+
+/* one noisy site is held at LOG_BURST, a quiet one still gets through */
+static void test_burst(void)
+{
+	const gint64 window = test_window();
+	guint written, lost, other, other_lost;
+
+	test_start();
+	for (guint i = 0; i < LOG_BURST + 5; i++)
+		g_message("burst %u", i);
+	g_message("other site");
+	test_stop();
+
+	if (test_window() != window) {
+		test_finish();
+		g_test_skip("crossed a rate limit window");
+		return;
+	}
+
+	/* nothing laps the ring here */
+	test_count("burst ", &written, &lost);
+	g_assert_cmpuint(lost, ==, 0);
+	g_assert_cmpuint(written, ==, LOG_BURST);
+	test_count("other site", &other, &other_lost);
+	g_assert_cmpuint(other, ==, 1);
+
+	test_finish();
+}
+
+/*
+ * Many distinct sites, each right at its limit, lap the ring before the
+ * flusher wakes up: nothing may be dropped without being counted.
+ */
+static void test_lap(void)
+{
+	const gint64 window = test_window();
+	gchar line[16];
+	guint written, lost;
+
+	g_assert_cmpuint(TEST_SITES * LOG_BURST, >, LOG_RING_SIZE);
+
+	test_start();
+	for (guint s = 0; s < TEST_SITES; s++) {
+		g_snprintf(line, sizeof(line), "%u", s + 1);
+		for (guint i = 0; i < LOG_BURST; i++)
+			g_log_structured(G_LOG_DOMAIN, G_LOG_LEVEL_MESSAGE,
+					"CODE_FILE", "lap.c",
+					"CODE_LINE", line,
+					"MESSAGE", "lap %u/%u", s, i);
+	}
+	test_stop();
+
+	if (test_window() != window) {
+		test_finish();
+		g_test_skip("crossed a rate limit window");
+		return;
+	}
+
+	test_count("lap ", &written, &lost);
+	g_assert_cmpuint(written + lost, ==, TEST_SITES * LOG_BURST);
+	g_assert_cmpuint(written, >=, LOG_RING_SIZE / 2);
+
+	test_finish();
+}
+
+int main(int argc, char *argv[])
+{
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add_func("/log/burst", test_burst);
+	g_test_add_func("/log/lap", test_lap);
+
+	return g_test_run();
+}
@@ -0,0 +1,111 @@
+/*
+ * mpd2irc - MPD->IRC gateway
+ *
+ * Copyright 2008-2011 Christoph Mende
+ * All rights reserved. Released under the 2-clause BSD license.
+ */
+
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "notify.h"
+
+/*
+ * Stands in for the service manager: binds a datagram socket, points
+ * $NOTIFY_SOCKET at it and checks what the daemon reports.
+ */
+
+static gchar *test_recv(gint fd);
+static void test_expect(gint fd, const gchar *state);
+
+static gchar *test_recv(gint fd)
+{
+	gchar buf[256];
+	gssize len;
+
+	len = recv(fd, buf, sizeof(buf) - 1, MSG_DONTWAIT);
+	if (len < 0)
+		return NULL;
+
+	buf[len] = '\0';
+	return g_strdup(buf);
+}
+
+static void test_expect(gint fd, const gchar *state)
+{
+	gchar *got = test_recv(fd);
+
+	g_assert_nonnull(got);
+	g_assert_cmpstr(got, ==, state);
+	g_free(got);
+}
+
+static void test_ready(void)
+{
+	struct sockaddr_un addr;
+	gchar *dir, *path;
+	gint fd;
+
+	dir = g_dir_make_tmp("mpd2irc-XXXXXX", NULL);
+	g_assert_nonnull(dir);
+	path = g_build_filename(dir, "notify", NULL);
+
+	fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+	g_assert_cmpint(fd, >=, 0);
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	g_strlcpy(addr.sun_path, path, sizeof(addr.sun_path));
+	g_assert_cmpint(bind(fd, (struct sockaddr *) &addr, sizeof(addr)),
+			==, 0);
+
+	g_setenv("NOTIFY_SOCKET", path, TRUE);
+	g_unsetenv("WATCHDOG_USEC");
+
+	g_assert_true(notify_init());
+	test_expect(fd, "STATUS=IRC connecting, MPD connecting");
+
+	/* ready only once both are up */
+	notify_up(NOTIFY_IRC);
+	test_expect(fd, "STATUS=IRC joined, MPD connecting");
+	notify_up(NOTIFY_MPD);
+	test_expect(fd, "READY=1");
+	test_expect(fd, "STATUS=IRC joined, MPD synced");
+
+	/* and never again after a reconnect */
+	notify_down(NOTIFY_MPD);
+	test_expect(fd, "STATUS=IRC joined, MPD connecting");
+	notify_up(NOTIFY_MPD);
+	test_expect(fd, "STATUS=IRC joined, MPD synced");
+
+	notify_cleanup();
+	test_expect(fd, "STOPPING=1");
+	g_assert_null(test_recv(fd));
+
+	close(fd);
+	unlink(path);
+	g_rmdir(dir);
+	g_free(path);
+	g_free(dir);
+}
+
+static void test_unset(void)
+{
+	g_unsetenv("NOTIFY_SOCKET");
+	g_assert_false(notify_init());
+}
+
+int main(int argc, char *argv[])
+{
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add_func("/notify/ready", test_ready);
+	g_test_add_func("/notify/unset", test_unset);
+
+	return g_test_run();
+}
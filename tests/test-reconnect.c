@@ -0,0 +1,175 @@
+/*
+ * mpd2irc - MPD->IRC gateway
+ *
+ * Copyright 2008-2011 Christoph Mende
+ * All rights reserved. Released under the 2-clause BSD license.
+ */
+
+
+#include <glib.h>
+
+#include "reconnect.h"
+#include "timer.h"
+
+/*
+ * Drives the reconnect engine on the virtual clock, hours of retries run
+ * in milliseconds.
+ */
+
+static gboolean test_attempt(gpointer data);
+static gint64 test_next_attempt(void);
+
+static guint attempts = 0;
+static gint64 attempted_at = 0;
+static struct reconnect r = { .name = "test", .attempt = test_attempt };
+
+static gboolean test_attempt(G_GNUC_UNUSED gpointer data)
+{
+	attempts++;
+	attempted_at = timer_now();
+	return FALSE;
+}
+
+/* runs the clock until the pending retry fires, returns its delay in ms */
+static gint64 test_next_attempt(void)
+{
+	const gint64 start = timer_now();
+	const guint before = attempts;
+
+	timer_advance((gint64) (RECONNECT_COOLDOWN + 1) * 1000);
+	g_assert_cmpuint(attempts, ==, before + 1);
+
+	return (attempted_at - start) / 1000;
+}
+
+static void test_setup(void)
+{
+	reconnect_cancel(&r);
+	timer_cleanup();
+	r.failures = 0;
+	r.outage = FALSE;
+}
+
+static void test_backoff(void)
+{
+	gint64 delay, max;
+
+	test_setup();
+
+	for (guint i = 1; i < RECONNECT_BREAKER; i++) {
+		reconnect_failed(&r);
+		max = MIN(RECONNECT_BASE << (i - 1), RECONNECT_MAX);
+		delay = test_next_attempt();
+
+		/* equal jitter: between half and the full delay */
+		g_assert_cmpint(delay, >=, max / 2);
+		g_assert_cmpint(delay, <=, max);
+	}
+}
+
+static void test_breaker(void)
+{
+	gint64 delay;
+
+	test_setup();
+
+	for (guint i = 1; i < RECONNECT_BREAKER; i++) {
+		reconnect_failed(&r);
+		test_next_attempt();
+	}
+
+	/* the circuit opens and stays open until a connection succeeds */
+	for (guint i = 0; i < 5; i++) {
+		reconnect_failed(&r);
+		delay = test_next_attempt();
+		g_assert_cmpint(delay, >=, RECONNECT_COOLDOWN / 2);
+		g_assert_cmpint(delay, <=, RECONNECT_COOLDOWN);
+	}
+
+	g_assert_true(reconnect_done(&r));
+	g_assert_false(r.outage);
+}
+
+static void test_lost(void)
+{
+	gint64 delay;
+
+	test_setup();
+
+	/* a connection that stayed up is retried right away */
+	g_assert_false(reconnect_done(&r));
+	timer_advance((gint64) (RECONNECT_STABLE + 1) * G_USEC_PER_SEC);
+	g_assert_true(reconnect_lost(&r));
+	delay = test_next_attempt();
+	g_assert_cmpint(delay, <, RECONNECT_BASE);
+	g_assert_cmpuint(r.failures, ==, 0);
+
+	/* the outage is only announced once */
+	reconnect_failed(&r);
+	test_next_attempt();
+	g_assert_false(reconnect_lost(&r));
+	test_next_attempt();
+}
+
+/* a server that accepts and then drops us must still be backed off */
+static void test_flapping(void)
+{
+	gint64 delay = 0;
+
+	test_setup();
+
+	for (guint i = 1; i <= RECONNECT_BREAKER; i++) {
+		reconnect_done(&r);
+		timer_advance(G_USEC_PER_SEC);
+		reconnect_lost(&r);
+		g_assert_cmpuint(r.failures, ==, i);
+		delay = test_next_attempt();
+	}
+	g_assert_cmpint(delay, >=, RECONNECT_COOLDOWN / 2);
+}
+
+static void test_stable(void)
+{
+	test_setup();
+
+	for (guint i = 0; i < 5; i++) {
+		reconnect_failed(&r);
+		test_next_attempt();
+	}
+
+	reconnect_done(&r);
+	timer_advance((gint64) (RECONNECT_STABLE - 1) * G_USEC_PER_SEC);
+	g_assert_cmpuint(r.failures, ==, 5);
+	timer_advance(2 * G_USEC_PER_SEC);
+	g_assert_cmpuint(r.failures, ==, 0);
+}
+
+static void test_cancel(void)
+{
+	const guint before = attempts;
+
+	test_setup();
+
+	reconnect_failed(&r);
+	reconnect_cancel(&r);
+	timer_advance((gint64) RECONNECT_COOLDOWN * 1000);
+	g_assert_cmpuint(attempts, ==, before);
+}
+
+int main(int argc, char *argv[])
+{
+	g_test_init(&argc, &argv, NULL);
+
+	/* the circuit breaker warns, which is expected here */
+	g_log_set_always_fatal(G_LOG_FATAL_MASK);
+	timer_set_virtual(TRUE);
+
+	g_test_add_func("/reconnect/backoff", test_backoff);
+	g_test_add_func("/reconnect/breaker", test_breaker);
+	g_test_add_func("/reconnect/lost", test_lost);
+	g_test_add_func("/reconnect/flapping", test_flapping);
+	g_test_add_func("/reconnect/stable", test_stable);
+	g_test_add_func("/reconnect/cancel", test_cancel);
+
+	return g_test_run();
+}